@@ -17,6 +17,9 @@
  */
 
 #ifndef ALLINONE
+#include <stdlib.h>
+#include <string.h>
+
 #define LUA_LIB
 #include <lua.h>
 #include <dbus/dbus.h>
@@ -188,6 +191,23 @@ static enum add_return add_signature(lua_State *L, int index,
 	return ADD_OK;
 }
 
+#ifdef DBUS_TYPE_UNIX_FD
+static enum add_return add_unix_fd(lua_State *L, int index,
+		DBusSignatureIter *type, DBusMessageIter *args)
+{
+	int fd;
+	if (!lua_isnumber(L, index))
+		return add_error(L, index, LUA_TNUMBER);
+	fd = (int)lua_tonumber(L, index);
+	/* the message gets a duplicate, so the caller still owns fd */
+	if (!dbus_message_iter_append_basic(args, DBUS_TYPE_UNIX_FD, &fd)) {
+		lua_pushfstring(L, "(%d is not a valid file descriptor)", fd);
+		return ADD_ERROR;
+	}
+	return ADD_OK;
+}
+#endif
+
 static enum add_return add_dict_entry(lua_State *L, int index,
 		DBusSignatureIter *type, DBusMessageIter *args)
 {
@@ -422,6 +442,10 @@ static add_function get_addfunc(DBusSignatureIter *type)
 		return add_object_path;
 	case DBUS_TYPE_SIGNATURE:
 		return add_signature;
+#ifdef DBUS_TYPE_UNIX_FD
+	case DBUS_TYPE_UNIX_FD:
+		return add_unix_fd;
+#endif
 	case DBUS_TYPE_ARRAY:
 		return add_array;
 	case DBUS_TYPE_STRUCT:
@@ -433,6 +457,105 @@ static add_function get_addfunc(DBusSignatureIter *type)
 	return add_not_implemented;
 }
 
+/*
+ * A pre-compiled signature: the signature iterator and add function
+ * of every complete type, so hot senders don't have to validate the
+ * signature and look up add functions again for every message.
+ */
+struct add_plan {
+	unsigned int n;
+	const char *signature;
+	struct add_step {
+		DBusSignatureIter type;
+		add_function af;
+	} step[];
+};
+
+EXPORT struct add_plan *add_plan_new(lua_State *L, const char *signature)
+{
+	struct add_plan *plan;
+	DBusSignatureIter type;
+	size_t len = strlen(signature);
+	unsigned int n = 0;
+	char *s;
+
+	if (!dbus_signature_validate(signature, NULL)) {
+		lua_pushfstring(L, "'%s' is not a valid signature", signature);
+		return NULL;
+	}
+
+	if (*signature) {
+		dbus_signature_iter_init(&type, signature);
+		do {
+			n++;
+		} while (dbus_signature_iter_next(&type));
+	}
+
+	plan = malloc(sizeof(struct add_plan)
+			+ n * sizeof(struct add_step) + len + 1);
+	if (plan == NULL) {
+		lua_pushliteral(L, "Out of memory");
+		return NULL;
+	}
+
+	/* keep our own copy of the signature, the
+	 * iterators below point into it */
+	s = (char *)&plan->step[n];
+	memcpy(s, signature, len + 1);
+
+	plan->n = n;
+	plan->signature = s;
+
+	if (n) {
+		struct add_step *step = plan->step;
+
+		dbus_signature_iter_init(&type, s);
+		do {
+			step->type = type;
+			step->af = get_addfunc(&type);
+			step++;
+		} while (dbus_signature_iter_next(&type));
+	}
+
+	return plan;
+}
+
+EXPORT void add_plan_free(struct add_plan *plan)
+{
+	free(plan);
+}
+
+EXPORT unsigned int add_planned_arguments(lua_State *L, int start, int argc,
+		const struct add_plan *plan, DBusMessage *msg)
+{
+	DBusMessageIter args;
+	unsigned int i;
+
+	if ((unsigned int)(argc - start + 1) < plan->n) {
+		lua_pushfstring(L, "type error adding value #%d "
+				"of '%s' (too few arguments)",
+				argc - start + 2, plan->signature);
+		return 1;
+	}
+
+	dbus_message_iter_init_append(msg, &args);
+
+	for (i = 0; i < plan->n; i++) {
+		/* the add functions get their own copy of the iterator */
+		DBusSignatureIter type = plan->step[i].type;
+
+		if (plan->step[i].af(L, start + i, &type, &args) != ADD_OK) {
+			lua_pushfstring(L, "type error adding value #%d of '%s' ",
+					i + 1, plan->signature);
+			lua_insert(L, -2);
+			lua_concat(L, 2);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 EXPORT unsigned int add_arguments(lua_State *L, int start, int argc,
 		const char *signature, DBusMessage *msg)
 {
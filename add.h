@@ -22,4 +22,11 @@
 unsigned int add_arguments(lua_State *L, int start, int argc,
 		const char *signature, DBusMessage *msg);
 
+struct add_plan;
+
+struct add_plan *add_plan_new(lua_State *L, const char *signature);
+void add_plan_free(struct add_plan *plan);
+unsigned int add_planned_arguments(lua_State *L, int start, int argc,
+		const struct add_plan *plan, DBusMessage *msg);
+
 #endif
@@ -0,0 +1,88 @@
+#!/usr/bin/env lua
+--[[ SimpleDBus benchmark
+
+Compare Proxy:parse() with the expat based Proxy:parse_expat().
+
+Usage: parse.lua [file.xml...]
+
+Without arguments the introspection data of the bus daemon is used,
+with its interfaces repeated under new names to get a large document.
+--]]
+
+local DBus = require 'simpledbus'
+
+local documents = {}
+if #arg > 0 then
+   for _, file in ipairs(arg) do
+      local f = assert(io.open(file))
+      documents[file] = f:read('*a')
+      f:close()
+   end
+else
+   local bus = assert(DBus.SessionBus())
+   local xml = assert(bus:call_method('org.freedesktop.DBus',
+      '/org/freedesktop/DBus', DBus.INTERFACE_INTROSPECTABLE,
+      'Introspect', false))
+   documents['bus daemon'] = xml
+
+   local body = xml:match('<node[^>]*>(.*)</node>')
+   local copies = {}
+   for i = 1, 200 do
+      copies[i] = body:gsub('(<interface name=")([^"]*)"', '%1%2.Copy'..i..'"')
+   end
+   documents['bus daemon x200'] =
+      '<node name="/org/freedesktop/DBus">'..table.concat(copies)..'</node>'
+end
+
+-- check both parsers agree
+local function same(a, b)
+   if type(a) ~= 'table' or type(b) ~= 'table' then
+      return a == b
+   end
+   if getmetatable(a) ~= getmetatable(b) then return false end
+   for k, v in pairs(a) do
+      -- methods point back to their interface
+      if not (k == 'interface' and type(v) == 'table')
+            and not same(v, b[k]) then
+         return false
+      end
+   end
+   for k in pairs(b) do
+      if a[k] == nil then return false end
+   end
+   return true
+end
+
+local function parse(f, xml)
+   local proxy = setmetatable({ object = '/' }, DBus.Proxy)
+   assert(f(proxy, xml))
+   proxy.object = nil
+   return proxy
+end
+
+local function bench(f, xml)
+   local n, t0 = 0, os.clock()
+   repeat
+      parse(f, xml)
+      n = n + 1
+   until os.clock() - t0 > 1
+   return (os.clock() - t0) / n
+end
+
+local Proxy = DBus.Proxy
+for name, xml in pairs(documents) do
+   local a, b = parse(Proxy.parse, xml), parse(Proxy.parse_expat, xml)
+   for k in pairs(a) do setmetatable(a[k], nil) end
+   for k in pairs(b) do setmetatable(b[k], nil) end
+   assert(same(a, b), name..': parsers disagree')
+
+   collectgarbage()
+   local expat = bench(Proxy.parse_expat, xml)
+   collectgarbage()
+   local new = bench(Proxy.parse, xml)
+   print(('%s (%d bytes):'):format(name, #xml))
+   print(('  expat  %9.1f us  %7.1f MB/s'):format(expat * 1e6, #xml / expat / 1e6))
+   print(('  parse  %9.1f us  %7.1f MB/s'):format(new * 1e6, #xml / new / 1e6))
+end
+
+-- vi: syntax=lua ts=3 sw=3 et:
@@ -46,6 +46,8 @@ struct parsedata {
 	char *sig_next;
 	char result[SIG_MAXLENGTH];
 	char *res_next;
+	XML_Parser parser;
+	int overflow;
 };
 
 static void start_element_handler(struct parsedata *data,
@@ -198,15 +200,32 @@ static void start_element_handler(struct parsedata *data,
 			if (!type)
 				return;
 
+			/* signal arguments are all "out" */
+			if (data->type == TAG_SIGNAL)
+				out = 0;
+
 			if (out) {
-				while (*type)
+				while (*type) {
+					if (data->res_next == data->result
+							+ SIG_MAXLENGTH - 1)
+						goto overflow;
 					*data->res_next++ = *type++;
+				}
 			} else {
-				while (*type)
+				while (*type) {
+					if (data->sig_next == data->signature
+							+ SIG_MAXLENGTH - 1)
+						goto overflow;
 					*data->sig_next++ = *type++;
+				}
 			}
 		}
 	}
+	return;
+
+overflow:
+	data->overflow = 1;
+	XML_StopParser(data->parser, XML_FALSE);
 }
 
 static void end_element_handler(struct parsedata *data,
@@ -236,7 +255,10 @@ static void end_element_handler(struct parsedata *data,
 
 			lua_pushvalue(data->L, 7); /* method/signal name */
 			lua_setfield(data->L, 8, "name");
-			lua_pushvalue(data->L, 5); /* interface */
+			/* methods get the interface table,
+			 * signals the interface name */
+			lua_pushvalue(data->L,
+					data->type == TAG_METHOD ? 5 : 4);
 			lua_setfield(data->L, 8, "interface");
 			lua_pushlstring(data->L, data->signature,
 					data->sig_next - data->signature);
@@ -264,25 +286,29 @@ static void end_element_handler(struct parsedata *data,
 }
 
 /*
- * Proxy:parse()
+ * Proxy:parse_expat()
  *
  * upvalue 1: Method
  * upvalue 2: Signal
  *
  * argument 1: proxy
  * argument 2: xml string
+ *
+ * The original expat based parser, kept around
+ * for comparison with Proxy:parse()
  */
-EXPORT int proxy_parse(lua_State *L)
+EXPORT int proxy_parse_expat(lua_State *L)
 {
 	XML_Parser p;
 	struct parsedata data;
 	const char *xml;
+	size_t len;
 
 	/* drop extra arguments */
 	lua_settop(L, 2);
 
 	/* get the xml string */
-	xml = luaL_checkstring(L, 2);
+	xml = luaL_checklstring(L, 2, &len);
 
 	/* put the object name on the stack */
 	lua_getfield(L, 1, "object");
@@ -305,6 +331,8 @@ EXPORT int proxy_parse(lua_State *L)
 	*data.result = '\0';
 	data.sig_next = data.signature;
 	data.res_next = data.result;
+	data.parser = p;
+	data.overflow = 0;
 
 	XML_SetUserData(p, &data);
 	XML_SetElementHandler(p,
@@ -312,14 +340,18 @@ EXPORT int proxy_parse(lua_State *L)
 			(XML_EndElementHandler)end_element_handler);
 
 	/* now parse the xml document inserting methods as we go */
-	if (!XML_Parse(p, xml, strlen(xml), 1)) {
+	if (!XML_Parse(p, xml, len, 1)) {
 #ifdef DEBUG
 		fprintf(stderr, "Parse error at line %d:\n%s\n",
 				(int)XML_GetCurrentLineNumber(p),
 				XML_ErrorString(XML_GetErrorCode(p)));
 #endif
+		XML_ParserFree(p);
 		lua_pushnil(L);
-		lua_pushliteral(L, "Error parsing introspection data");
+		if (data.overflow)
+			lua_pushliteral(L, "Signature too long");
+		else
+			lua_pushliteral(L, "Error parsing introspection data");
 		return 2;
 	}
 
@@ -330,3 +362,528 @@ EXPORT int proxy_parse(lua_State *L)
 	lua_pushboolean(L, 1);
 	return 1;
 }
+
+/*
+ * What follows is a parser made for introspection data only. It walks
+ * the document once, never copies it and only looks at the handful of
+ * elements and attributes DBus introspection uses. Comments, processing
+ * instructions, doctype declarations, CDATA sections and text are
+ * skipped, and entities are only decoded in the names we push to Lua.
+ */
+
+enum {
+	ATTR_NAME,
+	ATTR_TYPE,
+	ATTR_DIRECTION,
+	ATTR_ACCESS,
+	ATTR_MAX
+};
+
+struct tag {
+	const char *name;
+	size_t name_len;
+	int closing;
+	int empty;
+	const char *attr[ATTR_MAX];
+	size_t attr_len[ATTR_MAX];
+};
+
+#define is_space(c) ((c) == ' ' || (c) == '\n' || (c) == '\t' || (c) == '\r')
+
+/* compare a string of known length to a literal */
+#define is_literal(s, len, lit) \
+	((len) == sizeof(lit) - 1 && !memcmp(s, lit, sizeof(lit) - 1))
+
+/*
+ * return a pointer just past the first occurrence of
+ * str in [p, end), or NULL if there is none
+ */
+static const char *skip_past(const char *p, const char *end,
+		const char *str, size_t len)
+{
+	while ((size_t)(end - p) >= len) {
+		p = memchr(p, *str, end - p - len + 1);
+		if (p == NULL)
+			return NULL;
+		if (!memcmp(p, str, len))
+			return p + len;
+		p++;
+	}
+	return NULL;
+}
+
+static int attribute_index(const char *name, size_t len)
+{
+	switch (len) {
+	case 4:
+		if (!memcmp(name, "name", 4))
+			return ATTR_NAME;
+		if (!memcmp(name, "type", 4))
+			return ATTR_TYPE;
+		break;
+	case 6:
+		if (!memcmp(name, "access", 6))
+			return ATTR_ACCESS;
+		break;
+	case 9:
+		if (!memcmp(name, "direction", 9))
+			return ATTR_DIRECTION;
+		break;
+	}
+	return -1;
+}
+
+/*
+ * read the next start or end tag from *pos
+ *
+ * returns 1 when a tag is found, 0 at the
+ * end of the document and -1 on errors
+ */
+static int next_tag(const char **pos, const char *end, struct tag *tag)
+{
+	const char *p = *pos;
+	int i;
+
+	for (;;) {
+		p = memchr(p, '<', end - p);
+		if (p == NULL) {
+			*pos = end;
+			return 0;
+		}
+		if (++p == end)
+			return -1;
+
+		if (*p == '?')
+			p = skip_past(p, end, "?>", 2);
+		else if (*p != '!')
+			break;
+		else if (end - p >= 3 && p[1] == '-' && p[2] == '-')
+			p = skip_past(p + 3, end, "-->", 3);
+		else if (end - p >= 8 && !memcmp(p, "![CDATA[", 8))
+			p = skip_past(p + 8, end, "]]>", 3);
+		else /* <!DOCTYPE ..>, internal subsets are not supported */
+			p = memchr(p, '>', end - p);
+
+		if (p == NULL)
+			return -1;
+	}
+
+	tag->closing = 0;
+	tag->empty = 0;
+	for (i = 0; i < ATTR_MAX; i++)
+		tag->attr[i] = NULL;
+
+	if (*p == '/') {
+		tag->closing = 1;
+		p++;
+	}
+
+	tag->name = p;
+	while (p < end && !is_space(*p) && *p != '>' && *p != '/')
+		p++;
+	tag->name_len = p - tag->name;
+	if (tag->name_len == 0)
+		return -1;
+
+	for (;;) {
+		const char *name, *value;
+		size_t len;
+		char quote;
+
+		while (p < end && is_space(*p))
+			p++;
+		if (p == end)
+			return -1;
+
+		if (*p == '>') {
+			p++;
+			break;
+		}
+		if (*p == '/') {
+			if (tag->closing || ++p == end || *p != '>')
+				return -1;
+			tag->empty = 1;
+			p++;
+			break;
+		}
+		if (tag->closing)
+			return -1;
+
+		/* attribute name */
+		name = p;
+		while (p < end && *p != '=' && !is_space(*p)
+				&& *p != '>' && *p != '/')
+			p++;
+		len = p - name;
+
+		while (p < end && is_space(*p))
+			p++;
+		if (len == 0 || p == end || *p != '=')
+			return -1;
+		p++;
+		while (p < end && is_space(*p))
+			p++;
+		if (p == end || (*p != '"' && *p != '\''))
+			return -1;
+
+		/* attribute value */
+		quote = *p++;
+		value = p;
+		p = memchr(p, quote, end - p);
+		if (p == NULL)
+			return -1;
+
+		i = attribute_index(name, len);
+		if (i >= 0) {
+			tag->attr[i] = value;
+			tag->attr_len[i] = p - value;
+		}
+		p++;
+	}
+
+	*pos = p;
+	return 1;
+}
+
+/*
+ * push an attribute value decoding the predefined
+ * entities and ASCII character references
+ */
+static void push_value(lua_State *L, const char *s, size_t len)
+{
+	const char *end = s + len;
+	const char *amp = memchr(s, '&', len);
+	luaL_Buffer b;
+
+	if (amp == NULL) {
+		lua_pushlstring(L, s, len);
+		return;
+	}
+
+	luaL_buffinit(L, &b);
+	do {
+		const char *semi;
+		size_t n;
+		int c = -1;
+
+		luaL_addlstring(&b, s, amp - s);
+
+		semi = memchr(amp, ';', end - amp);
+		if (semi == NULL) {
+			s = amp;
+			break;
+		}
+		n = semi - amp - 1;
+
+		if (is_literal(amp + 1, n, "lt"))
+			c = '<';
+		else if (is_literal(amp + 1, n, "gt"))
+			c = '>';
+		else if (is_literal(amp + 1, n, "amp"))
+			c = '&';
+		else if (is_literal(amp + 1, n, "quot"))
+			c = '"';
+		else if (is_literal(amp + 1, n, "apos"))
+			c = '\'';
+		else if (n > 1 && amp[1] == '#') {
+			const char *d = amp + 2;
+			int base = 10;
+
+			if (*d == 'x') {
+				base = 16;
+				d++;
+			}
+			for (c = 0; d < semi && c < 128; d++) {
+				if (*d >= '0' && *d <= '9')
+					c = c*base + *d - '0';
+				else if (base == 16 && *d >= 'a' && *d <= 'f')
+					c = c*base + *d - 'a' + 10;
+				else if (base == 16 && *d >= 'A' && *d <= 'F')
+					c = c*base + *d - 'A' + 10;
+				else
+					break;
+			}
+			if (d < semi || c == 0 || c >= 128)
+				c = -1;
+		}
+
+		if (c < 0) /* leave anything else as it is */
+			luaL_addlstring(&b, amp, semi + 1 - amp);
+		else
+			luaL_addchar(&b, c);
+
+		s = semi + 1;
+		amp = memchr(s, '&', end - s);
+	} while (amp != NULL);
+
+	luaL_addlstring(&b, s, end - s);
+	luaL_pushresult(&b);
+}
+
+/*
+ * count the members and properties of the interface starting
+ * at p, so the tables can be created with the right size
+ */
+static void count_members(const char *p, const char *end,
+		int *members, int *properties)
+{
+	int m = 0, n = 0;
+
+	while ((p = memchr(p, '<', end - p)) != NULL) {
+		p++;
+		if (end - p >= 10 && !memcmp(p, "/interface", 10))
+			break;
+		if (end - p >= 7 && (!memcmp(p, "method", 6)
+					|| !memcmp(p, "signal", 6))
+				&& (is_space(p[6]) || p[6] == '>'
+					|| p[6] == '/'))
+			m++;
+		else if (end - p >= 9 && !memcmp(p, "property", 8)
+				&& is_space(p[8]))
+			n++;
+	}
+
+	*members = m;
+	*properties = n;
+}
+
+struct scandata {
+	lua_State *L;
+	unsigned int level;
+	unsigned int interface;
+	int type;
+	size_t sig_len;
+	size_t res_len;
+	char signature[SIG_MAXLENGTH];
+	char result[SIG_MAXLENGTH];
+};
+
+/*
+ * while parsing the stack looks like
+ *   4: interface name, 5: interface, 6: interface.properties
+ *   7: member name,    8: member table
+ *
+ * returns 0 on success and -1 if a signature is too long
+ */
+static int scan_start(struct scandata *data, const struct tag *tag,
+		const char *p, const char *end)
+{
+	lua_State *L = data->L;
+	size_t len;
+
+	data->level++;
+
+	switch (data->level) {
+	case 2:
+		if (!is_literal(tag->name, tag->name_len, "interface")
+				|| tag->attr[ATTR_NAME] == NULL)
+			return 0;
+		{
+			int members, properties;
+
+			count_members(p, end, &members, &properties);
+
+			push_value(L, tag->attr[ATTR_NAME],
+					tag->attr_len[ATTR_NAME]);
+			lua_createtable(L, 0, members + 2);
+			lua_pushvalue(L, 4);
+			lua_setfield(L, 5, "name");
+			lua_createtable(L, 0, properties);
+			lua_pushvalue(L, 6);
+			lua_setfield(L, 5, "properties");
+			lua_pushvalue(L, 1);
+			lua_setmetatable(L, 5);
+		}
+		data->interface = 1;
+		break;
+
+	case 3:
+		if (!data->interface || tag->attr[ATTR_NAME] == NULL)
+			return 0;
+
+		if (is_literal(tag->name, tag->name_len, "method"))
+			data->type = TAG_METHOD;
+		else if (is_literal(tag->name, tag->name_len, "signal"))
+			data->type = TAG_SIGNAL;
+		else if (is_literal(tag->name, tag->name_len, "property")) {
+			if (tag->attr[ATTR_TYPE] == NULL
+					|| tag->attr[ATTR_ACCESS] == NULL)
+				return 0;
+			data->type = TAG_PROPERTY;
+		} else
+			return 0;
+
+		push_value(L, tag->attr[ATTR_NAME], tag->attr_len[ATTR_NAME]);
+
+		/* check if the field is already set */
+		lua_pushvalue(L, 7);
+		lua_rawget(L, data->type == TAG_PROPERTY ? 6 : 5);
+		if (!lua_isnil(L, 8)) {
+			/* if it is, don't add it again */
+			lua_settop(L, 6);
+			data->type = TAG_NONE;
+			return 0;
+		}
+		lua_pop(L, 1);
+
+		if (data->type == TAG_PROPERTY) {
+			lua_createtable(L, 0, 2);
+			lua_pushlstring(L, tag->attr[ATTR_TYPE],
+					tag->attr_len[ATTR_TYPE]);
+			lua_setfield(L, 8, "type");
+			lua_pushlstring(L, tag->attr[ATTR_ACCESS],
+					tag->attr_len[ATTR_ACCESS]);
+			lua_setfield(L, 8, "access");
+			lua_rawset(L, 6);
+			data->type = TAG_NONE;
+			return 0;
+		}
+
+		lua_createtable(L, 0, 4);
+		lua_pushvalue(L, lua_upvalueindex(data->type));
+		lua_setmetatable(L, 8);
+		break;
+
+	case 4:
+		if (data->type == TAG_NONE || tag->attr[ATTR_TYPE] == NULL
+				|| !is_literal(tag->name, tag->name_len, "arg"))
+			return 0;
+
+		len = tag->attr_len[ATTR_TYPE];
+
+		/* signal arguments are all "out", method
+		 * arguments are "in" unless stated otherwise */
+		if (data->type == TAG_METHOD && tag->attr[ATTR_DIRECTION]
+				&& !is_literal(tag->attr[ATTR_DIRECTION],
+					tag->attr_len[ATTR_DIRECTION], "in")) {
+			if (data->res_len + len >= SIG_MAXLENGTH)
+				return -1;
+			memcpy(data->result + data->res_len,
+					tag->attr[ATTR_TYPE], len);
+			data->res_len += len;
+		} else {
+			if (data->sig_len + len >= SIG_MAXLENGTH)
+				return -1;
+			memcpy(data->signature + data->sig_len,
+					tag->attr[ATTR_TYPE], len);
+			data->sig_len += len;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static void scan_end(struct scandata *data, const struct tag *tag)
+{
+	lua_State *L = data->L;
+
+	data->level--;
+
+	switch (data->level) {
+	case 1:
+		if (!data->interface
+				|| !is_literal(tag->name, tag->name_len,
+					"interface"))
+			return;
+
+		lua_settop(L, 5);
+		lua_settable(L, 1);
+
+		data->interface = 0;
+		break;
+	case 2:
+		if (data->type == TAG_NONE)
+			return;
+
+		lua_pushvalue(L, 7); /* method/signal name */
+		lua_setfield(L, 8, "name");
+		/* methods get the interface table,
+		 * signals the interface name */
+		lua_pushvalue(L, data->type == TAG_METHOD ? 5 : 4);
+		lua_setfield(L, 8, "interface");
+		lua_pushlstring(L, data->signature, data->sig_len);
+		lua_setfield(L, 8, "signature");
+
+		if (data->type == TAG_METHOD) {
+			lua_pushlstring(L, data->result, data->res_len);
+			lua_setfield(L, 8, "result");
+		} else {
+			lua_pushvalue(L, 3); /* object name */
+			lua_setfield(L, 8, "object");
+		}
+
+		lua_rawset(L, 5);
+		data->sig_len = data->res_len = 0;
+		data->type = TAG_NONE;
+		break;
+	}
+}
+
+/*
+ * Proxy:parse()
+ *
+ * upvalue 1: Method
+ * upvalue 2: Signal
+ *
+ * argument 1: proxy
+ * argument 2: xml string
+ */
+EXPORT int proxy_parse(lua_State *L)
+{
+	struct scandata data;
+	struct tag tag;
+	const char *p, *end;
+	size_t len;
+	unsigned int elements = 0;
+	int r;
+
+	/* drop extra arguments */
+	lua_settop(L, 2);
+
+	/* get the xml string */
+	p = luaL_checklstring(L, 2, &len);
+	end = p + len;
+
+	/* put the object name on the stack */
+	lua_getfield(L, 1, "object");
+	if (lua_isnil(L, 3))
+		return luaL_argerror(L, 2, "no object set in the proxy");
+
+	data.L = L;
+	data.level = 0;
+	data.interface = 0;
+	data.type = TAG_NONE;
+	data.sig_len = 0;
+	data.res_len = 0;
+
+	/* now parse the xml document inserting methods as we go */
+	while ((r = next_tag(&p, end, &tag)) > 0) {
+		if (!tag.closing) {
+			elements++;
+			if (scan_start(&data, &tag, p, end)) {
+				lua_pushnil(L);
+				lua_pushliteral(L, "Signature too long");
+				return 2;
+			}
+			if (!tag.empty)
+				continue;
+		}
+
+		if (data.level == 0) {
+			r = -1;
+			break;
+		}
+		scan_end(&data, &tag);
+	}
+
+	if (r < 0 || data.level != 0 || elements == 0) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Error parsing introspection data");
+		return 2;
+	}
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
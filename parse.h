@@ -20,5 +20,6 @@
 #define _PARSE_H
 
 int proxy_parse(lua_State *L);
+int proxy_parse_expat(lua_State *L);
 
 #endif
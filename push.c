@@ -98,6 +98,16 @@ static void push_string(lua_State *L, DBusMessageIter *args)
 	lua_pushstring(L, s);
 }
 
+#ifdef DBUS_TYPE_UNIX_FD
+static void push_unix_fd(lua_State *L, DBusMessageIter *args)
+{
+	int fd;
+	/* this is a new duplicate which the receiver must close */
+	dbus_message_iter_get_basic(args, &fd);
+	lua_pushnumber(L, (lua_Number) fd);
+}
+#endif
+
 static void push_variant(lua_State *L, DBusMessageIter *args)
 {
 	DBusMessageIter variant;
@@ -220,6 +230,10 @@ static pushfunc get_pushfunc(DBusMessageIter *args)
 	case DBUS_TYPE_OBJECT_PATH:
 	case DBUS_TYPE_SIGNATURE:
 		return push_string;
+#ifdef DBUS_TYPE_UNIX_FD
+	case DBUS_TYPE_UNIX_FD:
+		return push_unix_fd;
+#endif
 	case DBUS_TYPE_ARRAY:
 		return push_array;
 	case DBUS_TYPE_STRUCT:
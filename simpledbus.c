@@ -16,16 +16,29 @@
  * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define LUA_LIB
 #include <lua.h>
 #include <lauxlib.h>
+#include <lualib.h>
 #include <dbus/dbus.h>
 
 #ifdef ALLINONE
@@ -50,12 +63,97 @@
 #  define lua_getuservalue(L, i) lua_getfenv(L, i)
 #  define lua_setuservalue(L, i) lua_setfenv(L, i)
 #  define lua_compare(L, i1, i2, op) lua_equal(L, i1, i2)
+#  define lua_rawlen(L, i) lua_objlen(L, i)
 #endif
 
-static DBusError err;
-static DBusObjectPathVTable vtable;
-static lua_State *mainThread = NULL;
-static int stop;
+/*
+ * a file descriptor the main loop polls for reading besides
+ * the watches of the connections. handle() is called with the
+ * thread running the main loop when it becomes readable. it may
+ * run Lua code in threads of its own, but must leave whatever
+ * stop() or an error put on top of the stack
+ */
+typedef struct lsource {
+	struct lsource *next;
+	int fd;
+	void (*handle)(struct lsource *s, lua_State *L);
+} LSource;
+
+/*
+ * everything about the main loop lives here, one for each
+ * Lua state, so states on different OS threads can each run
+ * their own loop
+ */
+typedef struct {
+	lua_State *main;	/* thread running mainloop(), or NULL */
+	int stop;
+	LSource *sources;
+	unsigned int sources_changed;
+	/* connections run by the main loop without being
+	 * passed to it, like those accepted by a server */
+	struct lcon *attached;
+	unsigned int attached_changed;
+	/* enabled libdbus timeouts, see add_timeout_cb() */
+	struct timer *timers;
+} LContext;
+
+/* the address is the registry key of the LContext */
+static const char context_key = 'c';
+
+/* the connection data slot and the lock for claiming
+ * shared connections are the same for all Lua states */
+static dbus_int32_t lcon_slot = -1;
+/* pending calls point to their struct pending_call */
+static dbus_int32_t pending_slot = -1;
+/* calls handled in-process point to their struct loopback */
+static dbus_int32_t loopback_slot = -1;
+/* calls answered after their handler yielded remember when they came in */
+static dbus_int32_t started_slot = -1;
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static LContext *get_context(lua_State *L)
+{
+	LContext *ctx;
+
+	lua_pushlightuserdata(L, (void *)&context_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	ctx = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	return ctx;
+}
+
+static void source_add(LContext *ctx, LSource *s)
+{
+	s->next = ctx->sources;
+	ctx->sources = s;
+	ctx->sources_changed = 1;
+}
+
+static void source_remove(LContext *ctx, LSource *s)
+{
+	LSource **p;
+
+	for (p = &ctx->sources; *p; p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			ctx->sources_changed = 1;
+			return;
+		}
+	}
+}
+
+/*
+ * move the error message on top of T to the main
+ * thread and stop the loop, unless it's stopping already
+ */
+static void stop_with_error(LContext *ctx, lua_State *T)
+{
+	if (ctx->stop == 0) {
+		lua_xmove(T, ctx->main, 1);
+		ctx->stop = -1;
+	}
+}
 
 #ifdef DEBUG
 static void dump_watch(DBusWatch *watch)
@@ -81,11 +179,326 @@ static void dump_watch(DBusWatch *watch)
 }
 #endif
 
-typedef struct {
+/*
+ * latency histograms, one for each interface.member. times are
+ * counted in nanoseconds in buckets of logarithmic size: every
+ * power of two is split in LAT_SUB buckets, so percentiles read
+ * from them are off by less than 1/LAT_SUB
+ */
+#define LAT_SUB_BITS	4
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS	40	/* about 18 minutes */
+#define LAT_BUCKETS	((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+#define LAT_HASH	32
+
+struct latency {
+	struct latency *next;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t buckets[LAT_BUCKETS];
+	char key[1];
+};
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * find the histogram for the interface and member of msg
+ * in table, or make a new one. returns NULL if out of memory
+ */
+static struct latency *latency_get(struct latency **table,
+		DBusMessage *msg)
+{
+	const char *interface = dbus_message_get_interface(msg);
+	const char *member = dbus_message_get_member(msg);
+	size_t ilen, mlen;
+	unsigned int h = 5381;
+	const char *p;
+	struct latency *l;
+
+	if (interface == NULL)
+		interface = "";
+	if (member == NULL)
+		member = "";
+
+	for (p = interface; *p; p++)
+		h = 33*h + (unsigned char)*p;
+	ilen = p - interface;
+	for (p = member; *p; p++)
+		h = 33*h + (unsigned char)*p;
+	mlen = p - member;
+	h %= LAT_HASH;
+
+	for (l = table[h]; l; l = l->next) {
+		if (strncmp(l->key, interface, ilen) == 0 &&
+				l->key[ilen] == '.' &&
+				strcmp(l->key + ilen + 1, member) == 0)
+			return l;
+	}
+
+	l = calloc(1, sizeof(struct latency) + ilen + 1 + mlen);
+	if (l == NULL)
+		return NULL;
+
+	l->min = UINT64_MAX;
+	memcpy(l->key, interface, ilen);
+	l->key[ilen] = '.';
+	memcpy(l->key + ilen + 1, member, mlen + 1);
+
+	l->next = table[h];
+	table[h] = l;
+	return l;
+}
+
+static void latency_free(struct latency **table)
+{
+	unsigned int i;
+
+	for (i = 0; i < LAT_HASH; i++) {
+		struct latency *l = table[i];
+
+		while (l) {
+			struct latency *next = l->next;
+
+			free(l);
+			l = next;
+		}
+		table[i] = NULL;
+	}
+}
+
+/*
+ * count the time since start
+ */
+static void latency_add(struct latency *l, uint64_t start)
+{
+	uint64_t t;
+	unsigned int i;
+
+	if (l == NULL)
+		return;
+
+	t = monotonic_ns() - start;
+
+	if (t < LAT_SUB)
+		i = t;
+	else {
+		int shift = 63 - __builtin_clzll(t) - LAT_SUB_BITS;
+
+		/* the top LAT_SUB_BITS + 1 bits pick the bucket */
+		i = shift * LAT_SUB + (t >> shift);
+		if (i >= LAT_BUCKETS)
+			i = LAT_BUCKETS - 1;
+	}
+
+	l->buckets[i]++;
+	l->count++;
+	l->sum += t;
+	if (t < l->min)
+		l->min = t;
+	if (t > l->max)
+		l->max = t;
+}
+
+/*
+ * libdbus timeouts of the connections and servers run by the
+ * main loop, like the reply timeouts of method calls. they fire
+ * every interval until disabled or removed. replies read by an
+ * I/O thread remove their timeout there, so the list of enabled
+ * timeouts is only touched with timer_lock held
+ */
+struct timer {
+	struct timer *next;
+	DBusTimeout *timeout;
+	LContext *ctx;
+	uint64_t deadline;
+	int added;
+};
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void timer_link(struct timer *t)
+{
+	t->deadline = monotonic_ns() +
+		(uint64_t)dbus_timeout_get_interval(t->timeout) * 1000000;
+	t->next = t->ctx->timers;
+	t->ctx->timers = t;
+	t->added = 1;
+}
+
+static void timer_unlink(struct timer *t)
+{
+	struct timer **p;
+
+	for (p = &t->ctx->timers; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+	t->added = 0;
+}
+
+static void toggle_timeout_cb(DBusTimeout *timeout, LContext *ctx)
+{
+	struct timer *t = dbus_timeout_get_data(timeout);
+
+	(void)ctx;
+
+	pthread_mutex_lock(&timer_lock);
+	if (t->added)
+		timer_unlink(t);
+	/* a timeout enabled again starts over */
+	if (dbus_timeout_get_enabled(timeout))
+		timer_link(t);
+	pthread_mutex_unlock(&timer_lock);
+}
+
+static dbus_bool_t add_timeout_cb(DBusTimeout *timeout, LContext *ctx)
+{
+	struct timer *t = malloc(sizeof(struct timer));
+
+	if (t == NULL)
+		return FALSE;
+
+	t->timeout = timeout;
+	t->ctx = ctx;
+	t->added = 0;
+	dbus_timeout_set_data(timeout, t, NULL);
+
+	toggle_timeout_cb(timeout, ctx);
+	return TRUE;
+}
+
+static void remove_timeout_cb(DBusTimeout *timeout, LContext *ctx)
+{
+	struct timer *t = dbus_timeout_get_data(timeout);
+
+	(void)ctx;
+
+	if (t == NULL)
+		return;
+
+	pthread_mutex_lock(&timer_lock);
+	if (t->added)
+		timer_unlink(t);
+	pthread_mutex_unlock(&timer_lock);
+
+	dbus_timeout_set_data(timeout, NULL, NULL);
+	free(t);
+}
+
+/*
+ * milliseconds until the next timeout is due, 0 if one
+ * is overdue, or -1 if there is nothing to wait for
+ */
+static int next_timeout(LContext *ctx)
+{
+	uint64_t now = monotonic_ns();
+	uint64_t first = UINT64_MAX;
+	struct timer *t;
+
+	pthread_mutex_lock(&timer_lock);
+	for (t = ctx->timers; t; t = t->next) {
+		if (t->deadline < first)
+			first = t->deadline;
+	}
+	pthread_mutex_unlock(&timer_lock);
+
+	if (first == UINT64_MAX)
+		return -1;
+	if (first <= now)
+		return 0;
+	/* round up, so we don't wake up just before it */
+	first = (first - now + 999999) / 1000000;
+	return first > INT_MAX ? INT_MAX : (int)first;
+}
+
+/*
+ * handle the timeouts which are due. the pending calls among
+ * them just queue an error reply for dispatchall() to deliver
+ */
+static void run_timeouts(LContext *ctx)
+{
+	uint64_t now = monotonic_ns();
+
+	while (1) {
+		DBusTimeout *timeout = NULL;
+		struct timer *t;
+
+		pthread_mutex_lock(&timer_lock);
+		for (t = ctx->timers; t; t = t->next) {
+			if (t->deadline <= now) {
+				t->deadline = now + (uint64_t)
+					dbus_timeout_get_interval(t->timeout)
+					* 1000000;
+				timeout = t->timeout;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&timer_lock);
+
+		if (timeout == NULL)
+			break;
+
+		/* this may remove the timeout, or others */
+		(void)dbus_timeout_handle(timeout);
+	}
+}
+
+typedef struct lcon {
 	DBusConnection *conn;
 	unsigned int watches_changed;
 	unsigned int nactive;
 	DBusWatch *active;
+	/* outgoing messages held back while corked */
+	unsigned int corked;
+	unsigned int nqueued;
+	unsigned int queue_size;
+	DBusMessage **queue;
+	dbus_uint32_t serial;
+	/* largest batch the socket takes in one piece, 0 if we
+	 * can't write it ourselves and -1 if we don't know yet */
+	int batch_max;
+	/* bumped whenever object paths come and go */
+	unsigned int generation;
+	LContext *ctx;
+	/* private connections must be closed */
+	int private;
+	/* set while an I/O thread reads the connection */
+	struct io_thread *io;
+	/* method calls waiting for a reply */
+	unsigned int npending;
+	/* well-known names the bus says we own */
+	unsigned int nnames;
+	char **names;
+	/* counters for Bus:stats() */
+	struct {
+		unsigned long sent[DBUS_NUM_MESSAGE_TYPES];
+		unsigned long received[DBUS_NUM_MESSAGE_TYPES];
+		unsigned long local_calls;
+		unsigned long dispatches;
+		unsigned long watch_rebuilds;
+		unsigned long threads;
+		unsigned long handler_errors;
+	} stats;
+	/* round trips of our method calls and
+	 * service times of the methods we export */
+	struct latency *calls[LAT_HASH];
+	struct latency *methods[LAT_HASH];
+	/* the list of attached connections and the registry
+	 * reference keeping us alive while we're on it */
+	struct lcon *next;
+	int ref;
 } LCon;
 
 static dbus_bool_t watch_list_insert(LCon *c, DBusWatch *watch)
@@ -204,6 +617,252 @@ static LCon *bus_check(lua_State *L, int index)
 	return (LCon *)lua_touserdata(L, index);
 }
 
+/*
+ * Corked connections hold back outgoing messages until they are
+ * flushed, which happens at the end of every main loop dispatch pass.
+ * libdbus writes every message with its own system call, so runs of
+ * signals are marshalled here and written with one sendmsg() per
+ * batch instead. Anything else goes through libdbus in order.
+ *
+ * A batch is only written while the outgoing queue of libdbus is
+ * empty, and it is kept small enough for a unix socket to take it
+ * whole or not at all. When the socket is full the batch is handed
+ * to libdbus like everything else, so flushing never waits on the
+ * peer and never leaves half a message on the wire.
+ */
+#define FLUSH_IOV 64
+#define FLUSH_BYTES 16384
+
+/* serials for signals we write ourselves, far from those of libdbus */
+#define FLUSH_SERIAL 0x80000000U
+
+struct batch {
+	int n;
+	size_t len;
+	struct iovec iov[FLUSH_IOV];
+	DBusMessage *msg[FLUSH_IOV];
+};
+
+/*
+ * return the socket to write batches to, or -1
+ */
+static int batch_socket(LCon *c)
+{
+	int fd;
+
+	/* never write the socket behind the back of an I/O thread */
+	if (c->io || c->batch_max == 0 ||
+			!dbus_connection_get_is_authenticated(c->conn) ||
+			!dbus_connection_get_socket(c->conn, &fd))
+		return -1;
+
+	if (c->batch_max < 0) {
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		int size;
+		socklen_t size_len = sizeof(size);
+
+		/* the kernel takes writes to unix sockets in pieces
+		 * of up to half the send buffer */
+		c->batch_max = 0;
+		if (getsockname(fd, (struct sockaddr *)&addr, &len) ||
+				addr.ss_family != AF_UNIX ||
+				getsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+					&size, &size_len))
+			return -1;
+
+		size = size/2 - 64;
+		c->batch_max = size < FLUSH_BYTES ? size : FLUSH_BYTES;
+		if (c->batch_max <= 0) {
+			c->batch_max = 0;
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+static const char *write_batch(LCon *c, int fd, struct batch *b)
+{
+	const char *ret = NULL;
+	ssize_t r = 0;
+	int i;
+
+	if (b->n == 0)
+		return NULL;
+
+	if (!dbus_connection_has_messages_to_send(c->conn)) {
+		struct msghdr m;
+
+		memset(&m, 0, sizeof(m));
+		m.msg_iov = b->iov;
+		m.msg_iovlen = b->n;
+		do {
+			r = sendmsg(fd, &m, MSG_DONTWAIT | MSG_NOSIGNAL);
+		} while (r < 0 && errno == EINTR);
+	}
+
+	for (i = 0; i < b->n; i++) {
+		DBusMessage *msg = b->msg[i];
+		size_t len = b->iov[i].iov_len;
+
+		if (r <= 0) {
+			/* not written, let libdbus do it */
+			if (!dbus_connection_send(c->conn, msg, NULL))
+				ret = "Out of memory";
+		} else if ((size_t)r < len) {
+			/* the socket took part of this message, which
+			 * shouldn't happen, but the rest must follow
+			 * before anything else does */
+			struct pollfd p;
+			char *data = (char *)b->iov[i].iov_base + r;
+
+			len -= r;
+			p.fd = fd;
+			p.events = POLLOUT;
+			while (len > 0) {
+				r = write(fd, data, len);
+				if (r > 0) {
+					data += r;
+					len -= r;
+				} else if (r < 0 && errno != EINTR &&
+						errno != EAGAIN &&
+						errno != EWOULDBLOCK) {
+					ret = strerror(errno);
+					break;
+				} else
+					(void)poll(&p, 1, -1);
+			}
+			r = 0;
+		} else
+			r -= len;
+
+		dbus_free(b->iov[i].iov_base);
+		dbus_message_unref(msg);
+	}
+
+	b->n = 0;
+	b->len = 0;
+	return ret;
+}
+
+static const char *flush_queue(LCon *c)
+{
+	struct batch b;
+	const char *ret = NULL;
+	const char *r;
+	unsigned int i;
+	int fd = batch_socket(c);
+
+	b.n = 0;
+	b.len = 0;
+
+	for (i = 0; i < c->nqueued; i++) {
+		DBusMessage *msg = c->queue[i];
+		char *buf;
+		int len;
+
+		c->queue[i] = NULL;
+		c->stats.sent[dbus_message_get_type(msg)]++;
+
+		if (fd >= 0 && dbus_message_get_type(msg)
+					== DBUS_MESSAGE_TYPE_SIGNAL &&
+				!dbus_message_contains_unix_fds(msg)) {
+			if (c->serial < FLUSH_SERIAL)
+				c->serial = FLUSH_SERIAL;
+			dbus_message_set_serial(msg, c->serial++);
+
+			if (dbus_message_marshal(msg, &buf, &len)) {
+				if (b.n == FLUSH_IOV ||
+						b.len + len > (size_t)c->batch_max) {
+					r = write_batch(c, fd, &b);
+					if (r)
+						ret = r;
+				}
+
+				if (len <= c->batch_max) {
+					b.iov[b.n].iov_base = buf;
+					b.iov[b.n].iov_len = len;
+					b.msg[b.n] = msg;
+					b.n++;
+					b.len += len;
+					continue;
+				}
+				dbus_free(buf);
+			}
+		}
+
+		/* write what we have so far to keep the order */
+		r = write_batch(c, fd, &b);
+		if (r)
+			ret = r;
+
+		if (!dbus_connection_send(c->conn, msg, NULL))
+			ret = "Out of memory";
+		dbus_message_unref(msg);
+	}
+
+	r = write_batch(c, fd, &b);
+	if (r)
+		ret = r;
+
+	c->nqueued = 0;
+
+	return ret;
+}
+
+/*
+ * send a message, or queue it if the connection is corked
+ * the reference to the message is taken over
+ */
+static dbus_bool_t queue_message(LCon *c, DBusMessage *msg)
+{
+	dbus_bool_t r;
+
+	if (!c->corked) {
+		c->stats.sent[dbus_message_get_type(msg)]++;
+		r = dbus_connection_send(c->conn, msg, NULL);
+		dbus_message_unref(msg);
+		return r;
+	}
+
+	if (c->nqueued == c->queue_size) {
+		unsigned int size = c->queue_size ? 2*c->queue_size : 16;
+		DBusMessage **queue = realloc(c->queue,
+				size * sizeof(DBusMessage *));
+
+		if (queue == NULL) {
+			dbus_message_unref(msg);
+			return FALSE;
+		}
+
+		c->queue = queue;
+		c->queue_size = size;
+	}
+
+	c->queue[c->nqueued++] = msg;
+	return TRUE;
+}
+
+/*
+ * send a message without waiting for a reply
+ * and push the result for Lua
+ */
+static int send_message(lua_State *L, LCon *c, DBusMessage *msg)
+{
+	dbus_bool_t r = queue_message(c, msg);
+
+	if (r == FALSE) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
 /*
  * Bus:get_signal_table()
  *
@@ -219,46 +878,66 @@ static int bus_get_signal_table(lua_State *L)
 	return 1;
 }
 
-static void method_return_handler(DBusPendingCall *pending, lua_State *T)
+/*
+ * Bus:cork()
+ *
+ * argument 1: bus
+ */
+static int bus_cork(lua_State *L)
 {
-	DBusMessage *msg = dbus_pending_call_steal_reply(pending);
-	int nargs;
+	LCon *c = bus_check(L, 1);
 
-	dbus_pending_call_unref(pending);
+	c->corked = 1;
 
-	/* remove the thread from the threads table */
-	lua_pushthread(T);
-	lua_pushnil(T);
-	lua_rawset(T, -3);
-	/* pop threads table from the thread */
-	lua_pop(T, 1);
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-	if (msg == NULL) {
-		lua_pushnil(T);
-		lua_pushliteral(T, "Reply null");
-		nargs = 2;
-	} else {
-		switch (dbus_message_get_type(msg)) {
-		case DBUS_MESSAGE_TYPE_METHOD_RETURN:
-			nargs = push_arguments(T, msg);
-			dbus_message_unref(msg);
-			break;
-		case DBUS_MESSAGE_TYPE_ERROR:
-			lua_pushnil(T);
-			dbus_set_error_from_message(&err, msg);
-			lua_pushstring(T, err.message);
-			dbus_error_free(&err);
-			dbus_message_unref(msg);
-			nargs = 2;
-			break;
-		default:
-			dbus_message_unref(msg);
-			lua_pushnil(T);
-			lua_pushliteral(T, "Unknown reply");
-			nargs = 2;
-		}
+/*
+ * Bus:flush()
+ *
+ * argument 1: bus
+ */
+static int bus_flush(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	const char *msg = flush_queue(c);
+
+	if (msg) {
+		lua_pushnil(L);
+		lua_pushstring(L, msg);
+		return 2;
 	}
 
+	/* without the main loop nothing else writes them */
+	if (c->ctx->main == NULL)
+		dbus_connection_flush(c->conn);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Bus:uncork()
+ *
+ * argument 1: bus
+ */
+static int bus_uncork(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+
+	c->corked = 0;
+
+	return bus_flush(L);
+}
+
+/*
+ * resume a suspended thread with the nargs values on top of its stack
+ * and take care of it when it finishes or errors. returns 1 if it
+ * errored and 0 otherwise
+ */
+static int resume_thread(LContext *ctx, lua_State *T, int nargs)
+{
 	switch (lua_resume(T, NULL, nargs)) {
 	case 0: /* thread finished */
 #ifdef DEBUG
@@ -267,103 +946,249 @@ static void method_return_handler(DBusPendingCall *pending, lua_State *T)
 				lua_gettop(T),
 				lua_typename(T, lua_type(T, 1)));
 #endif
-		if (lua_iscfunction(T, 1) && lua_tocfunction(T, 1)(T)
-				&& stop == 0) {
-			/* move error message to main thread */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
-	case LUA_YIELD: /* thread yielded again */
+		if (!lua_iscfunction(T, 1) || !lua_tocfunction(T, 1)(T))
+			return 0;
 		break;
-	default:
-		if (stop == 0) {
-			/* move error message to main */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
+	case LUA_YIELD: /* thread yielded again */
+		return 0;
 	}
+
+	stop_with_error(ctx, T);
+	return 1;
 }
 
 /*
- * Bus:call_method()
- *
- * argument 1: bus
- * argument 2: target
- * argument 3: object
- * argument 4: interface
- * argument 5: method
- * argument 6: no reply
- * argument 7: signature (optional)
- * ...
+ * push the values of a method reply, or nil and an
+ * error message, and let go of the reply
  */
-static int bus_call_method(lua_State *L)
+static int push_reply(lua_State *L, DBusMessage *msg)
 {
-	LCon *c = bus_check(L, 1);
-	const char *interface;
-	DBusMessage *msg;
-	DBusMessage *ret;
-
-#ifdef DEBUG
-	printf("Calling:\n  %s\n  %s\n  %s\n  %s\n  %s\n",
-				lua_tostring(L, 2),
-				lua_tostring(L, 3),
-				lua_tostring(L, 4),
-				lua_tostring(L, 5),
-				lua_tostring(L, 7));
-	fflush(stdout);
-#endif
-
-	/* create a new method call and check for errors */
-	interface = lua_tostring(L, 4);
-	if (interface && *interface == '\0')
-		interface = NULL;
+	DBusError err;
+	int nargs;
 
-	msg = dbus_message_new_method_call(
-				lua_tostring(L, 2),
-				lua_tostring(L, 3),
-				interface,
-				lua_tostring(L, 5));
 	if (msg == NULL) {
 		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
+		lua_pushliteral(L, "Reply null");
 		return 2;
 	}
 
-	/* get the signature and add arguments */
-	if (lua_isstring(L, 7)) {
-		const char *signature = lua_tostring(L, 7);
-		if (*signature &&
-				add_arguments(L, 8, lua_gettop(L), signature, msg)) {
-			dbus_message_unref(msg);
-			return lua_error(L);
-		}
+	switch (dbus_message_get_type(msg)) {
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+		nargs = push_arguments(L, msg);
+		break;
+	case DBUS_MESSAGE_TYPE_ERROR:
+		lua_pushnil(L);
+		dbus_error_init(&err);
+		dbus_set_error_from_message(&err, msg);
+		lua_pushstring(L, err.message);
+		dbus_error_free(&err);
+		nargs = 2;
+		break;
+	default:
+		lua_pushnil(L);
+		lua_pushliteral(L, "Unknown reply");
+		nargs = 2;
 	}
+	dbus_message_unref(msg);
 
-	if (lua_toboolean(L, 6)) {
-		dbus_bool_t ret = dbus_connection_send(c->conn, msg, NULL);
-		dbus_message_unref(msg);
+	return nargs;
+}
 
-		if (ret == FALSE) {
-			lua_pushnil(L);
-			lua_pushliteral(L, "Out of memory");
-			return 2;
-		}
+/*
+ * like push_reply(), but if result isn't NULL refuse
+ * method returns which don't have that signature
+ */
+static int push_checked_reply(lua_State *L, DBusMessage *msg,
+		const char *result)
+{
+	const char *signature;
 
-		/* return true */
-		lua_pushboolean(L, 1);
-		return 1;
+	if (result == NULL || msg == NULL ||
+			dbus_message_get_type(msg)
+				!= DBUS_MESSAGE_TYPE_METHOD_RETURN)
+		return push_reply(L, msg);
+
+	signature = dbus_message_get_signature(msg);
+	if (strcmp(signature, result) == 0)
+		return push_reply(L, msg);
+
+	lua_pushnil(L);
+	lua_pushfstring(L, "Reply has signature '%s', expected '%s'",
+			signature, result);
+	dbus_message_unref(msg);
+	return 2;
+}
+
+/*
+ * resume a thread which yielded the threads
+ * table waiting for the reply to a method call
+ */
+static int resume_with_reply(LContext *ctx, lua_State *T,
+		DBusMessage *msg, const char *result)
+{
+	int ref;
+	int r;
+
+	/* remove the thread from the threads table */
+	lua_pushthread(T);
+	lua_pushnil(T);
+	lua_rawset(T, -3);
+	/* pop threads table from the thread */
+	lua_pop(T, 1);
+	/* ..but don't let it be collected while it runs */
+	lua_pushthread(T);
+	ref = luaL_ref(T, LUA_REGISTRYINDEX);
+
+	r = resume_thread(ctx, T, push_checked_reply(T, msg, result));
+
+	luaL_unref(ctx->main, LUA_REGISTRYINDEX, ref);
+	return r;
+}
+
+/*
+ * what pending calls remember about themselves
+ */
+struct pending_call {
+	LCon *c;
+	struct latency *latency;
+	uint64_t start;
+	/* the reply signature a bound method expects */
+	const char *result;
+	char buf[DBUS_MAXIMUM_SIGNATURE_LENGTH + 1];
+};
+
+static void method_return_handler(DBusPendingCall *pending, lua_State *T)
+{
+	DBusMessage *msg = dbus_pending_call_steal_reply(pending);
+	struct pending_call *p = dbus_pending_call_get_data(pending,
+			pending_slot);
+	LCon *c = NULL;
+	char result[DBUS_MAXIMUM_SIGNATURE_LENGTH + 1];
+	const char *r = NULL;
+
+	if (p) {
+		c = p->c;
+		if (p->result)
+			r = strcpy(result, p->result);
+		c->npending--;
+		if (msg)
+			c->stats.received[dbus_message_get_type(msg)]++;
+		latency_add(p->latency, p->start);
+	}
+
+	/* this frees p */
+	dbus_pending_call_unref(pending);
+
+	if (resume_with_reply(get_context(T), T, msg, r) && c)
+		c->stats.handler_errors++;
+}
+
+/*
+ * a method call to one of our own objects is handled right
+ * away without going through the bus. the caller holds a
+ * reference to the call until the reply is delivered
+ */
+struct loopback {
+	lua_State *caller;	/* waiting thread, or NULL */
+	DBusMessage *call;
+	DBusMessage *reply;	/* if it came before the caller waited */
+	struct latency *latency;
+	uint64_t start;
+	/* the reply signature a bound method expects */
+	const char *result;
+	char buf[DBUS_MAXIMUM_SIGNATURE_LENGTH + 1];
+};
+
+/*
+ * send the reply to a method call, or hand it
+ * to the caller if the call was made in-process
+ */
+static dbus_bool_t deliver_reply(LCon *c, struct loopback *lb,
+		DBusMessage *reply)
+{
+	char result[DBUS_MAXIMUM_SIGNATURE_LENGTH + 1];
+	const char *r = NULL;
+	lua_State *T;
+
+	if (lb == NULL)
+		return queue_message(c, reply);
+
+	T = lb->caller;
+	if (T == NULL) {
+		lb->reply = reply;
+		return TRUE;
 	}
 
+	latency_add(lb->latency, lb->start);
+	if (lb->result)
+		r = strcpy(result, lb->result);
+	/* this frees lb */
+	dbus_message_unref(lb->call);
+
+	if (resume_with_reply(c->ctx, T, reply, r))
+		c->stats.handler_errors++;
+	return TRUE;
+}
+
+#define LOCAL_WAIT -2
+static int call_local(lua_State *L, LCon *c, DBusMessage *msg,
+		const char *result);
+
+/*
+ * send a method call and push the reply, or yield
+ * the calling thread if the main loop is running.
+ * if result isn't NULL the reply must have that signature
+ *
+ * the connection must be at stack index 1
+ */
+static int call_message(lua_State *L, LCon *c, DBusMessage *msg,
+		int no_reply, const char *result)
+{
+	DBusMessage *ret;
+	DBusError err;
+	struct latency *l;
+	uint64_t start;
+
+	if (no_reply)
+		return send_message(L, c, msg);
+
+	/* don't overtake messages held back by cork() */
+	if (c->nqueued)
+		(void)flush_queue(c);
+
+	l = latency_get(c->calls, msg);
+	start = monotonic_ns();
+
 	/* if (!lua_pushthread(L)) { / * L can be yielded */
-	if (mainThread) { /* main loop is running */
+	if (c->ctx->main) { /* main loop is running */
 		DBusPendingCall *pending;
+		struct pending_call *p;
+		int r;
+
+		/* calls to ourselves don't need the bus */
+		r = call_local(L, c, msg, result);
+		if (r == LOCAL_WAIT) {
+			struct loopback *lb = dbus_message_get_data(msg,
+					loopback_slot);
+
+			lb->latency = l;
+			lb->start = start;
+			lb->result = result ? strcpy(lb->buf, result) : NULL;
+			goto wait;
+		}
+		if (r >= 0) {
+			latency_add(l, start);
+			return r;
+		}
 
+		c->stats.sent[DBUS_MESSAGE_TYPE_METHOD_CALL]++;
 		if (!dbus_connection_send_with_reply(c->conn, msg, &pending, -1)) {
 			dbus_message_unref(msg);
 			lua_pushnil(L);
 			lua_pushliteral(L, "Out of memory");
 			return 2;
 		}
+		dbus_message_unref(msg);
 
 		if (!dbus_pending_call_set_notify(pending,
 					(DBusPendingCallNotifyFunction)
@@ -372,7 +1197,19 @@ static int bus_call_method(lua_State *L)
 			lua_pushliteral(L, "Out of memory");
 			return 2;
 		}
-
+		p = malloc(sizeof(struct pending_call));
+		if (p) {
+			p->c = c;
+			p->latency = l;
+			p->start = start;
+			p->result = result ? strcpy(p->buf, result) : NULL;
+			if (dbus_pending_call_set_data(pending, pending_slot,
+						p, free))
+				c->npending++;
+			else
+				free(p);
+		}
+wait:
 		/* get the threads table */
 		lua_settop(L, 1);
 		lua_getuservalue(L, 1);
@@ -386,45 +1223,88 @@ static int bus_call_method(lua_State *L)
 	/* lua_pop(L, 1); */
 
 	/* L is the main thread, so we call the method synchronously */
+	if (c->io) {
+		dbus_message_unref(msg);
+		lua_pushnil(L);
+		lua_pushliteral(L, "Blocking calls need the I/O thread stopped");
+		return 2;
+	}
+	dbus_error_init(&err);
+	c->stats.sent[DBUS_MESSAGE_TYPE_METHOD_CALL]++;
 	ret = dbus_connection_send_with_reply_and_block(c->conn, msg, -1, &err);
+	latency_add(l, start);
 
 	/* free message */
 	dbus_message_unref(msg);
 
 	/* check reply */
-	if (ret == NULL) {
+	if (ret == NULL && dbus_error_is_set(&err)) {
 		lua_pushnil(L);
-		if (dbus_error_is_set(&err)) {
-			lua_pushstring(L, err.message);
-			dbus_error_free(&err);
-		} else
-			lua_pushliteral(L, "Reply null");
+		lua_pushstring(L, err.message);
+		dbus_error_free(&err);
 		return 2;
 	}
+	if (ret)
+		c->stats.received[dbus_message_get_type(ret)]++;
 
-	switch (dbus_message_get_type(ret)) {
-	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
-		{
-			/* read the parameters */
-			int nargs = push_arguments(L, ret);
-			dbus_message_unref(ret);
+	return push_checked_reply(L, ret, result);
+}
 
-			return nargs;
-		}
-	case DBUS_MESSAGE_TYPE_ERROR:
+/*
+ * Bus:call_method()
+ *
+ * argument 1: bus
+ * argument 2: target
+ * argument 3: object
+ * argument 4: interface
+ * argument 5: method
+ * argument 6: no reply
+ * argument 7: signature (optional)
+ * ...
+ */
+static int bus_call_method(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	const char *interface;
+	DBusMessage *msg;
+
+#ifdef DEBUG
+	printf("Calling:\n  %s\n  %s\n  %s\n  %s\n  %s\n",
+				lua_tostring(L, 2),
+				lua_tostring(L, 3),
+				lua_tostring(L, 4),
+				lua_tostring(L, 5),
+				lua_tostring(L, 7));
+	fflush(stdout);
+#endif
+
+	/* create a new method call and check for errors */
+	interface = lua_tostring(L, 4);
+	if (interface && *interface == '\0')
+		interface = NULL;
+
+	msg = dbus_message_new_method_call(
+				lua_tostring(L, 2),
+				lua_tostring(L, 3),
+				interface,
+				lua_tostring(L, 5));
+	if (msg == NULL) {
 		lua_pushnil(L);
-		dbus_set_error_from_message(&err, ret);
-		lua_pushstring(L, err.message);
-		dbus_error_free(&err);
-		dbus_message_unref(ret);
+		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
 
-	dbus_message_unref(ret);
+	/* get the signature and add arguments */
+	if (lua_isstring(L, 7)) {
+		const char *signature = lua_tostring(L, 7);
+		if (*signature &&
+				add_arguments(L, 8, lua_gettop(L), signature, msg)) {
+			dbus_message_unref(msg);
+			return lua_error(L);
+		}
+	}
 
-	lua_pushnil(L);
-	lua_pushliteral(L, "Unknown reply");
-	return 2;
+	return call_message(L, c, msg, lua_toboolean(L, 6), NULL);
 }
 
 /* this magic string representation of an incoming
@@ -432,17 +1312,20 @@ static int bus_call_method(lua_State *L)
 #define push_signal_string(L, object, interface, signal) \
 	lua_pushfstring(L, "%s\n%s\n%s", object, interface, signal)
 
-static DBusHandlerResult signal_handler(DBusConnection *conn,
-		DBusMessage *msg, lua_State *S)
+/*
+ * run the handler stored in the signal table under the key
+ * for the object, interface and name of the signal. Handlers
+ * stored with an empty object get signals from all objects,
+ * and the sender and object path as their first arguments.
+ */
+static int run_signal_handler(LCon *c, lua_State *S,
+		DBusMessage *msg, int all)
 {
 	lua_State *T;
-
-	if (msg == NULL || dbus_message_get_type(msg)
-			!= DBUS_MESSAGE_TYPE_SIGNAL)
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	int nargs = 0;
 
 	push_signal_string(S,
-			dbus_message_get_path(msg),
+			all ? "" : dbus_message_get_path(msg),
 			dbus_message_get_interface(msg),
 			dbus_message_get_member(msg));
 #ifdef DEBUG
@@ -452,19 +1335,26 @@ static DBusHandlerResult signal_handler(DBusConnection *conn,
 	lua_rawget(S, 1); /* signal handler table */
 	if (lua_type(S, 2) != LUA_TFUNCTION) {
 		lua_settop(S, 1);
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		return 0;
 	}
 
 	/* create new Lua thread */
 	T = lua_newthread(S);
 	lua_insert(S, 2);
+	c->stats.threads++;
 	/* push nil to let whoever sees the end of this thread
 	 * know that nothing further needs to be done */
 	lua_pushnil(T);
 	/* move the Lua signal handler there */
 	lua_xmove(S, T, 1);
 
-	switch (lua_resume(T, S, push_arguments(T, msg))) {
+	if (all) {
+		lua_pushstring(T, dbus_message_get_sender(msg));
+		lua_pushstring(T, dbus_message_get_path(msg));
+		nargs = 2;
+	}
+
+	switch (lua_resume(T, S, nargs + push_arguments(T, msg))) {
 	case 0: /* thread finished */
 	case LUA_YIELD:	/* thread yielded */
 		/* just forget about it */
@@ -472,14 +1362,29 @@ static DBusHandlerResult signal_handler(DBusConnection *conn,
 		break;
 	default: /* thread errored */
 		lua_settop(S, 1);
-		if (stop == 0) {
-			/* move error message to main */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
+		c->stats.handler_errors++;
+		stop_with_error(c->ctx, T);
 	}
 
-	return DBUS_HANDLER_RESULT_HANDLED;
+	return 1;
+}
+
+static DBusHandlerResult signal_handler(DBusConnection *conn,
+		DBusMessage *msg, lua_State *S)
+{
+	LCon *c;
+	int handled;
+
+	if (msg == NULL || dbus_message_get_type(msg)
+			!= DBUS_MESSAGE_TYPE_SIGNAL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	c = dbus_connection_get_data(conn, lcon_slot);
+	handled = run_signal_handler(c, S, msg, 0);
+	handled |= run_signal_handler(c, S, msg, 1);
+
+	return handled ? DBUS_HANDLER_RESULT_HANDLED
+		: DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
 /*
@@ -494,12 +1399,11 @@ static DBusHandlerResult signal_handler(DBusConnection *conn,
  */
 static int bus_send_signal(lua_State *L)
 {
-	DBusConnection *conn = bus_check(L, 1)->conn;
+	LCon *c = bus_check(L, 1);
 	const char *path = luaL_checkstring(L, 2);
 	const char *interface = luaL_checkstring(L, 3);
 	const char *name = luaL_checkstring(L, 4);
 	DBusMessage *msg;
-	dbus_bool_t r;
 
 	if (interface && *interface == '\0')
 		interface = NULL;
@@ -520,662 +1424,4018 @@ static int bus_send_signal(lua_State *L)
 		}
 	}
 
-	r = dbus_connection_send(conn, msg, NULL);
-	dbus_message_unref(msg);
-
-	if (r == FALSE) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
-		return 2;
-	}
-
-	/* return true */
-	lua_pushboolean(L, 1);
-	return 1;
+	return send_message(L, c, msg);
 }
 
-static int send_reply(lua_State *T)
+typedef struct {
+	LCon *c;
+	DBusMessage *msg;
+	struct add_plan *plan;
+} LEmitter;
+
+static LEmitter *emitter_check(lua_State *L, int index)
 {
-	DBusConnection *conn = lua_touserdata(T, 2);
-	DBusMessage *msg = lua_touserdata(T, 3);
-	DBusMessage *reply;
-	int top = lua_gettop(T);
+	int r;
 
-	/* check if the method returned an error */
-	if (top >= 6 && lua_isnil(T, 5)) {
-		const char *name = lua_tostring(T, 6);
-		const char *message = (top >= 7) ? lua_tostring(T, 7) : NULL;
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index,
+				"expected a signal emitter");
 
-		if (name == NULL) {
-			dbus_message_unref(msg);
-			lua_pushliteral(T, "Return #1 nil, "
-					"expected error name as #2");
-			return 1;
-		}
-		if (message && *message == '\0')
-			message = NULL;
+	r = lua_compare(L, lua_upvalueindex(1), -1, LUA_OPEQ);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index,
+				"expected a signal emitter");
 
-		reply = dbus_message_new_error(msg, name, message);
-		dbus_message_unref(msg);
-		if (reply == NULL) {
-			lua_pushliteral(T, "Out of memory");
-			return 1;
-		}
-	} else {
-		const char *signature;
+	return (LEmitter *)lua_touserdata(L, index);
+}
 
-		reply = dbus_message_new_method_return(msg);
-		dbus_message_unref(msg);
-		if (reply == NULL) {
-			lua_pushliteral(T, "Out of memory");
-			return 1;
-		}
+/*
+ * Bus:prepare_signal()
+ *
+ * upvalue 1: Bus
+ * upvalue 2: Emitter
+ *
+ * argument 1: connection
+ * argument 2: path
+ * argument 3: interface
+ * argument 4: name
+ * argument 5: signature (optional)
+ */
+static int bus_prepare_signal(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	const char *interface = luaL_checkstring(L, 3);
+	const char *name = luaL_checkstring(L, 4);
+	const char *signature = luaL_optstring(L, 5, "");
+	LEmitter *e;
+
+	/* validate everything once, so emitting
+	 * doesn't have to do it again */
+	if (!dbus_validate_path(path, NULL))
+		return luaL_argerror(L, 2, "invalid object path");
+	if (!dbus_validate_interface(interface, NULL))
+		return luaL_argerror(L, 3, "invalid interface name");
+	if (!dbus_validate_member(name, NULL))
+		return luaL_argerror(L, 4, "invalid signal name");
 
-		signature = lua_tostring(T, 4);
-		if (signature && *signature &&
-				add_arguments(T, 5, top, signature, reply)) {
-			/* add_arguments() pushes its own error message */
-			dbus_message_unref(reply);
-			return 1;
-		}
-	}
+	/* drop extra arguments */
+	lua_settop(L, 5);
 
-	if (!dbus_connection_send(conn, reply, NULL)) {
-		lua_pushliteral(T, "Out of memory");
-		return 1;
+	e = lua_newuserdata(L, sizeof(LEmitter));
+	e->c = c;
+	e->msg = NULL;
+	e->plan = NULL;
+
+	/* set the metatable */
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_setmetatable(L, 6);
+
+	/* keep a reference to the connection */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, 7, 1);
+	lua_setuservalue(L, 6);
+
+	/* create the template message */
+	e->msg = dbus_message_new_signal(path, interface, name);
+	if (e->msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
 	}
 
-	dbus_message_unref(reply);
+	/* ..and compile the signature */
+	if (*signature) {
+		e->plan = add_plan_new(L, signature);
+		if (e->plan == NULL)
+			return lua_error(L);
+	}
 
-	return 0;
+	return 1;
 }
 
-static DBusHandlerResult method_call_handler(DBusConnection *conn,
-		DBusMessage *msg, lua_State *O)
+/*
+ * Emitter:emit()
+ * Emitter.__call()
+ *
+ * upvalue 1: Emitter
+ *
+ * argument 1: emitter
+ * ...
+ */
+static int emitter_emit(lua_State *L)
 {
-	lua_State *T;
-
-#ifdef DEBUG
-	printf("Received message: path = %s,"
-			" interface = %s, member = %s\n",
-			dbus_message_get_path(msg),
-			dbus_message_get_interface(msg),
-			dbus_message_get_member(msg));
-	fflush(stdout);
-#endif
+	LEmitter *e = emitter_check(L, 1);
+	DBusMessage *msg = dbus_message_copy(e->msg);
 
-	lua_pushfstring(O, "%s.%s",
-			dbus_message_get_interface(msg),
-			dbus_message_get_member(msg));
+	if (msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
 
-	lua_rawget(O, 1);
-	if (!lua_istable(O, 2)) {
-		lua_settop(O, 1);
-#ifdef DEBUG
-		printf("..not handled\n"); fflush(stdout);
-#endif
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	if (e->plan &&
+			add_planned_arguments(L, 2, lua_gettop(L), e->plan, msg)) {
+		dbus_message_unref(msg);
+		return lua_error(L);
 	}
 
-	/* create a new thread to run the method in */
-	T = lua_newthread(O);
-	/* ..and insert it before the function table */
-	lua_insert(O, 2);
+	return send_message(L, e->c, msg);
+}
 
-	/* push the send_reply function */
-	lua_pushcclosure(T, send_reply, 0);
+/*
+ * Emitter.__gc()
+ */
+static int emitter_gc(lua_State *L)
+{
+	LEmitter *e = lua_touserdata(L, 1);
 
-	/* push the connection */
-	lua_pushlightuserdata(T, conn);
+	if (e->msg)
+		dbus_message_unref(e->msg);
+	if (e->plan)
+		add_plan_free(e->plan);
 
-	/* push the message */
-	dbus_message_ref(msg);
-	lua_pushlightuserdata(T, msg);
+	return 0;
+}
 
-	/* move the return signature and the function to T */
-	lua_rawgeti(O, 3, 2);
-	lua_rawgeti(O, 3, 3);
-	lua_xmove(O, T, 2);
+typedef struct {
+	LCon *c;
+	DBusMessage *msg;
+	struct add_plan *plan;
+	int no_reply;
+	/* signature replies must have, or NULL */
+	char *result;
+} LBoundMethod;
 
-	/* forget about the function table */
-	lua_settop(O, 2);
+static LBoundMethod *bound_method_check(lua_State *L, int index)
+{
+	int r;
 
-	switch (lua_resume(T, O, push_arguments(T, msg))) {
-	case 0: /* thread finished */
-		if (send_reply(T) && stop == 0) {
-			/* move error message to main thread and error */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
-	case LUA_YIELD:	/* thread yielded */
-		/* forget about the thread */
-		lua_settop(O, 1);
-		break;
-	default: /* thread errored */
-		lua_settop(O, 1);
-		if (stop == 0) {
-			/* move error message to main */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
-	}
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index,
+				"expected a bound method");
 
-	return DBUS_HANDLER_RESULT_HANDLED;
+	r = lua_compare(L, lua_upvalueindex(1), -1, LUA_OPEQ);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index,
+				"expected a bound method");
+
+	return (LBoundMethod *)lua_touserdata(L, index);
 }
 
 /*
- * Bus:register_object_path()
+ * Bus:bind_method()
  *
- * argument 1: connection
- * argument 2: path
- * argument 3: method table
+ * upvalue 1: Bus
+ * upvalue 2: BoundMethod
+ *
+ * argument 1: bus
+ * argument 2: target (optional)
+ * argument 3: object
+ * argument 4: interface (optional)
+ * argument 5: method
+ * argument 6: no reply
+ * argument 7: signature (optional)
+ * argument 8: reply signature (optional)
  */
-static int bus_register_object_path(lua_State *L)
+static int bus_bind_method(lua_State *L)
 {
 	LCon *c = bus_check(L, 1);
-	const char *path = luaL_checkstring(L, 2);
-	lua_State *O;
+	const char *target = luaL_optstring(L, 2, NULL);
+	const char *object = luaL_checkstring(L, 3);
+	const char *interface = luaL_optstring(L, 4, NULL);
+	const char *method = luaL_checkstring(L, 5);
+	const char *signature = luaL_optstring(L, 7, "");
+	const char *result = luaL_optstring(L, 8, NULL);
+	LBoundMethod *m;
 
-	luaL_checktype(L, 3, LUA_TTABLE);
+	if (interface && *interface == '\0')
+		interface = NULL;
+
+	/* validate everything once, so calling
+	 * doesn't have to do it again */
+	if (target && !dbus_validate_bus_name(target, NULL))
+		return luaL_argerror(L, 2, "invalid bus name");
+	if (!dbus_validate_path(object, NULL))
+		return luaL_argerror(L, 3, "invalid object path");
+	if (interface && !dbus_validate_interface(interface, NULL))
+		return luaL_argerror(L, 4, "invalid interface name");
+	if (!dbus_validate_member(method, NULL))
+		return luaL_argerror(L, 5, "invalid method name");
+	if (result && !dbus_signature_validate(result, NULL))
+		return luaL_argerror(L, 8, "invalid signature");
 
 	/* drop extra arguments */
-	lua_settop(L, 3);
+	lua_settop(L, 8);
 
-	/* get the signal/thread table of the conection */
-	lua_getuservalue(L, 1);
-	/* ..and move it before the path */
-	lua_insert(L, 2);
+	m = lua_newuserdata(L, sizeof(LBoundMethod));
+	m->c = c;
+	m->msg = NULL;
+	m->plan = NULL;
+	m->no_reply = lua_toboolean(L, 6);
+	m->result = NULL;
 
-	/* check if we already registered this object path */
-	lua_pushvalue(L, 3);
-	lua_rawget(L, 2);
-	if (lua_isthread(L, 5)) {
-		/* just replace the method table */
-		O = lua_tothread(L, 5);
-		lua_xmove(L, O, 1);
-		lua_replace(O, 2);
-		/* return true */
-		lua_pushboolean(L, 1);
-		return 1;
-	}
-	/* clear result of lua_rawget() */
-	lua_settop(L, 4);
+	/* set the metatable */
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_setmetatable(L, 9);
 
-	/* move method table before path */
-	lua_insert(L, 3);
+	/* keep a reference to the connection */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, 10, 1);
+	lua_setuservalue(L, 9);
 
-	/* create thread for storing object data */
-	O = lua_newthread(L);
-	if (O == NULL) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
-		return 2;
+	if (result) {
+		m->result = strdup(result);
+		if (m->result == NULL) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "Out of memory");
+			return 2;
+		}
 	}
 
-	/* register the object path */
-	if (!dbus_connection_register_object_path(c->conn, path, &vtable, O)) {
+	/* create the template message */
+	m->msg = dbus_message_new_method_call(target, object,
+			interface, method);
+	if (m->msg == NULL) {
 		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
+	if (m->no_reply)
+		dbus_message_set_no_reply(m->msg, TRUE);
 
-	/* save the thread in the thread table */
-	lua_rawset(L, 2);
-
-	/* move method table to the thread*/
-	lua_xmove(L, O, 1);
+	/* ..and compile the signature */
+	if (*signature) {
+		m->plan = add_plan_new(L, signature);
+		if (m->plan == NULL)
+			return lua_error(L);
+	}
 
-	/* return true */
-	lua_pushboolean(L, 1);
 	return 1;
 }
 
 /*
- * Bus:unregister_object_path()
+ * BoundMethod.__call()
  *
- * argument 1: connection
- * argument 2: path
+ * upvalue 1: BoundMethod
+ *
+ * argument 1: bound method
+ * ...
  */
-static int bus_unregister_object_path(lua_State *L)
+static int bound_method_call(lua_State *L)
 {
-	LCon *c = bus_check(L, 1);
-	const char *path = luaL_checkstring(L, 2);
-
-	/* drop extra arguments */
-	lua_settop(L, 2);
-
-	/* get the signal/thread table of the conection */
-	lua_getuservalue(L, 1);
-	/* ..and move it before the path */
-	lua_insert(L, 2);
-
-	lua_pushvalue(L, 3);
-	lua_rawget(L, 2);
-	if (!lua_isthread(L, 4))
-		return luaL_error(L, "Object path not registered");
-	lua_settop(L, 3);
+	LBoundMethod *m = bound_method_check(L, 1);
+	DBusMessage *msg = dbus_message_copy(m->msg);
 
-	lua_pushnil(L);
-	if (!dbus_connection_unregister_object_path(c->conn, path)) {
+	if (msg == NULL) {
+		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
 
-	lua_rawset(L, 2);
+	if (m->plan &&
+			add_planned_arguments(L, 2, lua_gettop(L), m->plan, msg)) {
+		dbus_message_unref(msg);
+		return lua_error(L);
+	}
 
-	/* return true */
-	lua_pushboolean(L, 1);
-	return 1;
+	/* replace the bound method by its connection */
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, 1);
+	lua_replace(L, 1);
+
+	return call_message(L, m->c, msg, m->no_reply, m->result);
 }
 
 /*
- * DBus.__gc()
+ * BoundMethod.__gc()
  */
-static int bus_gc(lua_State *L)
+static int bound_method_gc(lua_State *L)
 {
-	LCon *c = lua_touserdata(L, 1);
-	dbus_connection_unref(c->conn);
+	LBoundMethod *m = lua_touserdata(L, 1);
+
+	if (m->msg)
+		dbus_message_unref(m->msg);
+	if (m->plan)
+		add_plan_free(m->plan);
+	free(m->result);
 
 	return 0;
 }
 
+typedef struct {
+	DBusMessage *msg;
+} LReply;
+
+static int reply_gc(lua_State *L);
+
 /*
- * mainloop()
+ * method handlers may return a Reply instead of their results,
+ * but send_reply() has no upvalues to check the metatable with.
+ * so look for our own __gc function in it instead
  */
-static struct pollfd *make_poll_struct(int n, LCon **c, nfds_t *nfds)
+static LReply *reply_check(lua_State *L, int index)
 {
-	struct pollfd *p;
-	struct pollfd *fds;
-	nfds_t total = 0;
-	int i;
-	DBusWatch *watch;
+	lua_CFunction gc;
 
-	for (i = 0; i < n; i++)
-		total += c[i]->nactive;
-	*nfds = total;
-
-	fds = malloc(total * sizeof(struct pollfd));
-	if (fds == NULL)
+	if (lua_type(L, index) != LUA_TUSERDATA
+			|| !lua_getmetatable(L, index))
 		return NULL;
 
-	p = fds;
-	for (i = 0; i < n; i++) {
-		for (watch = c[i]->active; watch;
-				watch = dbus_watch_get_data(watch)) {
-			unsigned int flags = dbus_watch_get_flags(watch);
+	lua_getfield(L, -1, "__gc");
+	gc = lua_tocfunction(L, -1);
+	lua_pop(L, 2);
 
-			p->fd = dbus_watch_get_unix_fd(watch);
-			p->events = POLLERR | POLLHUP;
-			p->revents = 0;
-
-			if (flags & DBUS_WATCH_READABLE)
-				p->events |= POLLIN;
-			if (flags & DBUS_WATCH_WRITABLE)
-				p->events |= POLLOUT;
+	return gc == reply_gc ? lua_touserdata(L, index) : NULL;
+}
 
-			p++;
-		}
+/*
+ * prepare_reply()
+ *
+ * upvalue 1: Reply
+ *
+ * argument 1: signature
+ * ...
+ *
+ * Marshal the results of a method once. Handlers returning
+ * the Reply just get a copy of the message sent back.
+ */
+static int simpledbus_prepare_reply(lua_State *L)
+{
+	const char *signature = luaL_optstring(L, 1, "");
+	LReply *r;
 
-		c[i]->watches_changed = 0;
+	r = lua_newuserdata(L, sizeof(LReply));
+	r->msg = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (r->msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
 	}
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+	lua_insert(L, 2);
 
-	return fds;
+	if (*signature &&
+			add_arguments(L, 3, lua_gettop(L), signature, r->msg))
+		return lua_error(L);
+
+	lua_settop(L, 2);
+	return 1;
 }
 
-static inline unsigned int dispatchall(int n, LCon **c)
+/*
+ * Reply.__gc()
+ */
+static int reply_gc(lua_State *L)
 {
-	unsigned int r = 0;
-	int i;
+	LReply *r = lua_touserdata(L, 1);
 
-	for (i = 0; i < n; i++) {
-		DBusConnection *conn = c[i]->conn;
+	if (r->msg)
+		dbus_message_unref(r->msg);
 
-		if (dbus_connection_get_dispatch_status(conn)
-				== DBUS_DISPATCH_DATA_REMAINS) {
-			while (dbus_connection_dispatch(conn)
-					== DBUS_DISPATCH_DATA_REMAINS);
-		}
+	return 0;
+}
 
-		r |= c[i]->watches_changed;
+/*
+ * copy a prepared reply and address it to the sender of msg
+ */
+static DBusMessage *copy_reply(LReply *r, DBusMessage *msg)
+{
+	DBusMessage *reply = dbus_message_copy(r->msg);
+	const char *sender = dbus_message_get_sender(msg);
+
+	if (reply == NULL)
+		return NULL;
+
+	if (!dbus_message_set_reply_serial(reply,
+				dbus_message_get_serial(msg))
+			|| (sender && !dbus_message_set_destination(reply,
+					sender))) {
+		dbus_message_unref(reply);
+		return NULL;
 	}
+	dbus_message_set_no_reply(reply, TRUE);
 
-	return r;
+	return reply;
 }
 
-static inline void handleall(int n, LCon **c, struct pollfd *p)
+/*
+ * add an <arg/> element to b for every
+ * complete type in signature
+ */
+static void add_args(luaL_Buffer *b, const char *signature,
+		const char *direction)
 {
-	int i;
-	DBusWatch *watch;
+	DBusSignatureIter iter;
 
-	for (i = 0; i < n; i++) {
-		for (watch = c[i]->active; watch;
-				watch = dbus_watch_get_data(watch)) {
-			if (p->revents) {
-				unsigned int flags = 0;
+	if (*signature == '\0')
+		return;
 
-				if (p->revents & POLLIN)
-					flags |= DBUS_WATCH_READABLE;
-				if (p->revents & POLLOUT)
-					flags |= DBUS_WATCH_WRITABLE;
-				if (p->revents & POLLERR)
-					flags |= DBUS_WATCH_ERROR;
-				if (p->revents & POLLHUP)
-					flags |= DBUS_WATCH_HANGUP;
+	dbus_signature_iter_init(&iter, signature);
+	do {
+		char *type = dbus_signature_iter_get_signature(&iter);
 
-				(void)dbus_watch_handle(watch, flags);
-				p->revents = 0;
-			}
-			p++;
+		luaL_addstring(b, "<arg direction=\"");
+		luaL_addstring(b, direction);
+		luaL_addstring(b, "\" type=\"");
+		if (type) {
+			luaL_addstring(b, type);
+			dbus_free(type);
 		}
+		luaL_addstring(b, "\" />");
+	} while (dbus_signature_iter_next(&iter));
+}
+
+/*
+ * method_xml()
+ *
+ * argument 1: method name
+ * argument 2: input signature
+ * argument 3: output signature
+ *
+ * Returns the introspection data of a method.
+ */
+static int simpledbus_method_xml(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	const char *in = luaL_optstring(L, 2, "");
+	const char *out = luaL_optstring(L, 3, "");
+	luaL_Buffer b;
+
+	if (!dbus_signature_validate(in, NULL))
+		return luaL_argerror(L, 2, "invalid signature");
+	if (!dbus_signature_validate(out, NULL))
+		return luaL_argerror(L, 3, "invalid signature");
+
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "<method name=\"");
+	luaL_addstring(&b, name);
+	luaL_addstring(&b, "\">");
+	add_args(&b, in, "in");
+	add_args(&b, out, "out");
+	luaL_addstring(&b, "</method>");
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+ * push the <interface/> element of the interface whose
+ * name is at index -2 and member table at index -1.
+ * strings are collected on the stack and concatenated
+ * in one go, since lua_next() needs the top of the stack
+ */
+static void push_fragment(lua_State *L)
+{
+	int members = lua_gettop(L);
+	int n = 3;
+
+	lua_pushliteral(L, "<interface name=\"");
+	lua_pushvalue(L, members - 1);
+	lua_pushliteral(L, "\">");
+
+	lua_pushnil(L);
+	while (lua_next(L, members)) {
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			/* keep the value below the key */
+			lua_insert(L, -2);
+			n++;
+		} else
+			lua_pop(L, 1);
+		luaL_checkstack(L, 2, "too many members");
 	}
+
+	lua_pushliteral(L, "</interface>");
+	lua_concat(L, n + 1);
 }
 
-static int simpledbus_mainloop(lua_State *L)
+/*
+ * Bus:introspect()
+ *
+ * upvalue 1: Bus
+ * upvalue 2: Reply
+ *
+ * argument 1: connection
+ * argument 2: path
+ * argument 3: interface table
+ * argument 4: cache table
+ *
+ * Returns a Reply with the introspection data of the object at
+ * path. The interface table maps interface names to tables of
+ * member XML. The cache table keeps the <interface/> fragments by
+ * name, and the reply at index 1 together with the connection and
+ * its generation, which changes when object paths are registered
+ * or unregistered. Drop a fragment and index 1 when an interface
+ * changes.
+ */
+static int bus_introspect(lua_State *L)
 {
-	LCon **c;
-	struct pollfd *fds;
-	nfds_t nfds;
-	int i;
-	int n = lua_gettop(L);
+	LCon *c = bus_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	char **children;
+	char **child;
+	LReply *r;
+	int n;
 
-	if (mainThread)
-		return luaL_error(L, "Another main loop is already running");
+	luaL_checktype(L, 3, LUA_TTABLE);
+	luaL_checktype(L, 4, LUA_TTABLE);
 
-	if (lua_isfunction(L, n))
-		n--;
+	/* drop extra arguments */
+	lua_settop(L, 4);
 
-	if (n < 1)
-		return luaL_error(L, "At least 1 DBus connection required");
+	/* reuse the reply if no object paths came or went */
+	lua_rawgeti(L, 4, 2);
+	lua_rawgeti(L, 4, 3);
+	if (lua_rawequal(L, 1, 6) && lua_isnumber(L, 5)
+			&& (unsigned int)lua_tonumber(L, 5) == c->generation) {
+		lua_rawgeti(L, 4, 1);
+		if (lua_isuserdata(L, 7))
+			return 1;
+	}
+	lua_settop(L, 4);
 
-	c = malloc(n * sizeof(LCon *));
-	if (c == NULL) {
+	/* build the fragments of new or changed interfaces */
+	lua_pushnil(L);
+	while (lua_next(L, 3)) {
+		if (!lua_istable(L, 6)) {
+			lua_pop(L, 1);
+			continue;
+		}
+
+		lua_pushvalue(L, 5);
+		lua_rawget(L, 4);
+		if (lua_isnil(L, 7)) {
+			lua_pop(L, 1);
+			push_fragment(L);
+			lua_pushvalue(L, 5);
+			lua_insert(L, -2);
+			lua_rawset(L, 4);
+		} else
+			lua_pop(L, 1);
+		lua_pop(L, 1);
+	}
+
+	if (!dbus_connection_list_registered(c->conn, path, &children)) {
 		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
 
-	for (i = 0; i < n; i++) {
-		/* don't use bus_check() so we can free c
-		 * before erroring
-		c[i] = bus_check(L, i+1);
-		*/
-		int r;
+	lua_pushliteral(L, "<!DOCTYPE node PUBLIC "
+		"\"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\"\n"
+		"\"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n"
+		"<node>");
+	n = 1;
 
-		if (lua_getmetatable(L, i+1) == 0) {
-			free(c);
-			return luaL_argerror(L, i+1,
-					"expected a DBus connection");
+	lua_pushnil(L);
+	while (lua_next(L, 3)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, 4);
+		if (lua_isstring(L, -1)) {
+			lua_insert(L, -2);
+			n++;
+		} else
+			lua_pop(L, 1);
+		if (!lua_checkstack(L, 2)) {
+			dbus_free_string_array(children);
+			return luaL_error(L, "too many interfaces");
 		}
+	}
 
-		r = lua_compare(L, lua_upvalueindex(1), -1, LUA_OPEQ);
-		lua_pop(L, 1);
-		if (r == 0) {
-			free(c);
-			return luaL_argerror(L, i+1,
-					"expected a DBus connection");
+	for (child = children; *child; child++) {
+		if (!lua_checkstack(L, 1)) {
+			dbus_free_string_array(children);
+			return luaL_error(L, "too many children");
 		}
+		lua_pushfstring(L, "<node name=\"%s\" />", *child);
+		n++;
+	}
+	dbus_free_string_array(children);
 
-		c[i] = lua_touserdata(L, i+1);
+	lua_pushliteral(L, "</node>");
+	lua_concat(L, n + 1);
+
+	/* wrap it up in a reply */
+	r = lua_newuserdata(L, sizeof(LReply));
+	r->msg = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (r->msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
 	}
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_setmetatable(L, -2);
 
-	fds = make_poll_struct(n, c, &nfds);
-	if (fds == NULL) {
-		free(c);
+	path = lua_tostring(L, -2);
+	if (!dbus_message_append_args(r->msg,
+				DBUS_TYPE_STRING, &path,
+				DBUS_TYPE_INVALID)) {
 		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
 
-	stop = 0;
-	mainThread = L;
+	/* remember it */
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, 4, 1);
+	lua_pushnumber(L, (lua_Number)c->generation);
+	lua_rawseti(L, 4, 2);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, 4, 3);
 
-	/* read, write, dispatch until we get a break */
-	while (1) {
-		unsigned int watches_changed = dispatchall(n, c);
-		int r;
+	return 1;
+}
 
-		if (stop)
-			goto exit;
+/*
+ * when a method call came in, for handlers which yield
+ */
+struct started {
+	struct latency *latency;
+	uint64_t start;
+};
 
-		if (watches_changed) {
-			free(fds);
-			fds = make_poll_struct(n, c, &nfds);
-			if (fds == NULL) {
-				free(c);
-				mainThread = NULL;
-				lua_pushnil(L);
-				lua_pushliteral(L, "Out of memory");
-				return 2;
-			}
-		}
-		r = poll(fds, nfds, 0);
-		if (r < 0) {
-			lua_pushnil(L);
-			lua_pushfstring(L, "Error polling DBus: %s",
-					strerror(errno));
-			stop = 2;
-			goto exit;
-		}
-		if (r == 0)
-			break;
+static void set_started(DBusMessage *msg, struct latency *l, uint64_t start)
+{
+	struct started *s;
 
-		handleall(n, c, fds);
-	}
+	if (l == NULL)
+		return;
 
-	/* if the last argument was a function,
-	 * start it in a new thread */
-	if (n < lua_gettop(L)) {
-		lua_State *T = lua_newthread(L);
-		lua_insert(L, n+1);
-		lua_xmove(L, T, 1);
+	s = malloc(sizeof(struct started));
+	if (s == NULL)
+		return;
 
-		switch (lua_resume(T, L, 0)) {
-		case 0: /* thread finished */
-		case LUA_YIELD:	/* thread yielded */
-			/* forget about the thread */
-			lua_settop(L, n);
-			break;
-		default: /* thread errored */
-			/* move error message to main thread */
-			lua_xmove(T, L, 1);
-			stop = -1;
-			goto exit;
-		}
-	}
+	s->latency = l;
+	s->start = start;
+	if (!dbus_message_set_data(msg, started_slot, s, free))
+		free(s);
+}
 
-	/* now run the real main loop */
-	while (1) {
-		unsigned int watches_changed = dispatchall(n, c);
+static int send_reply(lua_State *T)
+{
+	LCon *c = lua_touserdata(T, 2);
+	DBusMessage *msg = lua_touserdata(T, 3);
+	struct loopback *lb = dbus_message_get_data(msg, loopback_slot);
+	struct started *s = dbus_message_get_data(msg, started_slot);
+	DBusMessage *reply;
+	int top = lua_gettop(T);
 
-		if (stop)
-			break;
+	if (s)
+		latency_add(s->latency, s->start);
 
-		if (watches_changed) {
-			free(fds);
-			fds = make_poll_struct(n, c, &nfds);
-			if (fds == NULL) {
-				free(c);
-				mainThread = NULL;
-				lua_pushnil(L);
-				lua_pushliteral(L, "Out of memory");
-				return 2;
-			}
+	/* check if the method returned an error */
+	if (top >= 6 && lua_isnil(T, 5)) {
+		const char *name = lua_tostring(T, 6);
+		const char *message = (top >= 7) ? lua_tostring(T, 7) : NULL;
+
+		if (name == NULL) {
+			dbus_message_unref(msg);
+			lua_pushliteral(T, "Return #1 nil, "
+					"expected error name as #2");
+			return 1;
 		}
-		if (poll(fds, nfds, -1) < 0) {
-			lua_pushnil(L);
-			lua_pushfstring(L, "Error polling DBus: %s",
-					strerror(errno));
-			stop = 2;
-			break;
+		if (message && *message == '\0')
+			message = NULL;
+
+		reply = dbus_message_new_error(msg, name, message);
+		dbus_message_unref(msg);
+		if (reply == NULL) {
+			lua_pushliteral(T, "Out of memory");
+			return 1;
+		}
+	} else if (top == 5 && reply_check(T, 5)) {
+		reply = copy_reply(lua_touserdata(T, 5), msg);
+		dbus_message_unref(msg);
+		if (reply == NULL) {
+			lua_pushliteral(T, "Out of memory");
+			return 1;
+		}
+	} else {
+		const char *signature;
+
+		reply = dbus_message_new_method_return(msg);
+		dbus_message_unref(msg);
+		if (reply == NULL) {
+			lua_pushliteral(T, "Out of memory");
+			return 1;
+		}
+
+		signature = lua_tostring(T, 4);
+		if (signature && *signature &&
+				add_arguments(T, 5, top, signature, reply)) {
+			/* add_arguments() pushes its own error message */
+			dbus_message_unref(reply);
+			return 1;
 		}
-		handleall(n, c, fds);
 	}
 
-exit:
-	free(c);
-	free(fds);
+	if (!deliver_reply(c, lb, reply)) {
+		lua_pushliteral(T, "Out of memory");
+		return 1;
+	}
 
-	mainThread = NULL;
+	return 0;
+}
+
+/*
+ * worker pools run methods in OS threads of their own, each with
+ * a Lua state which loaded the module the pool was created with.
+ * the calls are queued for the workers, and the replies they build
+ * are sent from the main loop when the eventfd says they are done
+ */
+struct job {
+	struct job *next;
+	DBusConnection *conn;
+	DBusMessage *msg;
+	DBusMessage *reply;
+	struct latency *latency;
+	uint64_t start;
+	char signature[1];
+};
+
+struct worker {
+	pthread_t thread;
+	lua_State *L;
+	struct lpool *pool;
+};
+
+typedef struct lpool {
+	LSource source;
+	LContext *ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job *todo;
+	struct job **todo_tail;
+	struct job *done;
+	struct job **done_tail;
+	int quit;
+	unsigned int nworkers;
+	struct worker *workers;
+} LPool;
+
+static int pool_gc(lua_State *L);
+
+static LPool *pool_check(lua_State *L, int index)
+{
+	lua_CFunction gc;
+
+	if (lua_type(L, index) != LUA_TUSERDATA
+			|| !lua_getmetatable(L, index))
+		return NULL;
+
+	lua_getfield(L, -1, "__gc");
+	gc = lua_tocfunction(L, -1);
+	lua_pop(L, 2);
+
+	return gc == pool_gc ? lua_touserdata(L, index) : NULL;
+}
+
+/*
+ * call the function of the module at index 1 named like
+ * the method of the job at index 2 and build the reply
+ */
+static int job_call(lua_State *L)
+{
+	struct job *j = lua_touserdata(L, 2);
+	const char *member = dbus_message_get_member(j->msg);
+	DBusMessage *reply;
+	int top;
+
+	lua_getfield(L, 1, member);
+	if (!lua_isfunction(L, 3))
+		return luaL_error(L, "No function %s in worker module", member);
+
+	lua_call(L, push_arguments(L, j->msg), LUA_MULTRET);
+	top = lua_gettop(L);
+
+	/* check if the method returned an error */
+	if (top >= 4 && lua_isnil(L, 3)) {
+		const char *name = lua_tostring(L, 4);
+		const char *message = (top >= 5) ? lua_tostring(L, 5) : NULL;
+
+		if (name == NULL)
+			return luaL_error(L, "Return #1 nil, "
+					"expected error name as #2");
+		if (message && *message == '\0')
+			message = NULL;
+
+		reply = dbus_message_new_error(j->msg, name, message);
+	} else {
+		reply = dbus_message_new_method_return(j->msg);
+		if (reply && j->signature[0] &&
+				add_arguments(L, 3, top, j->signature, reply)) {
+			dbus_message_unref(reply);
+			return lua_error(L);
+		}
+	}
+	if (reply == NULL)
+		return luaL_error(L, "Out of memory");
+
+	j->reply = reply;
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	LPool *p = w->pool;
+	lua_State *L = w->L;
+	struct job *j;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (p->todo == NULL && !p->quit)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->quit)
+			break;
+
+		j = p->todo;
+		p->todo = j->next;
+		if (p->todo == NULL)
+			p->todo_tail = &p->todo;
+		pthread_mutex_unlock(&p->lock);
+
+		/* the module table stays at index 1 */
+		lua_pushcfunction(L, job_call);
+		lua_pushvalue(L, 1);
+		lua_pushlightuserdata(L, j);
+		if (lua_pcall(L, 2, 0, 0))
+			j->reply = dbus_message_new_error(j->msg,
+					DBUS_ERROR_FAILED, lua_tostring(L, -1));
+		lua_settop(L, 1);
+
+		pthread_mutex_lock(&p->lock);
+		j->next = NULL;
+		*p->done_tail = j;
+		p->done_tail = &j->next;
+		(void)write(p->source.fd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+static void job_free(struct job *j)
+{
+	if (j->reply)
+		dbus_message_unref(j->reply);
+	dbus_message_unref(j->msg);
+	dbus_connection_unref(j->conn);
+	free(j);
+}
+
+/*
+ * send the replies of finished jobs
+ */
+static void pool_handle(LSource *s, lua_State *L)
+{
+	LPool *p = (LPool *)s;
+	struct job *j;
+	struct job *next;
+	uint64_t n;
+
+	(void)read(s->fd, &n, sizeof(n));
+
+	pthread_mutex_lock(&p->lock);
+	j = p->done;
+	p->done = NULL;
+	p->done_tail = &p->done;
+	pthread_mutex_unlock(&p->lock);
+
+	for (; j; j = next) {
+		LCon *c = dbus_connection_get_data(j->conn, lcon_slot);
+
+		next = j->next;
+		if (j->reply && !dbus_message_get_no_reply(j->msg)) {
+			if (c) {
+				latency_add(j->latency, j->start);
+				(void)deliver_reply(c, dbus_message_get_data(
+						j->msg, loopback_slot), j->reply);
+			} else {
+				(void)dbus_connection_send(j->conn,
+						j->reply, NULL);
+				dbus_message_unref(j->reply);
+			}
+			j->reply = NULL;
+		}
+		job_free(j);
+	}
+}
+
+/*
+ * hand msg to the workers of the pool
+ */
+static dbus_bool_t pool_submit(LPool *p, DBusConnection *conn,
+		DBusMessage *msg, const char *signature,
+		struct latency *latency, uint64_t start)
+{
+	size_t len = strlen(signature);
+	struct job *j = malloc(sizeof(struct job) + len);
+
+	if (j == NULL)
+		return FALSE;
+
+	j->next = NULL;
+	j->conn = dbus_connection_ref(conn);
+	j->msg = dbus_message_ref(msg);
+	j->reply = NULL;
+	j->latency = latency;
+	j->start = start;
+	memcpy(j->signature, signature, len + 1);
+
+	pthread_mutex_lock(&p->lock);
+	*p->todo_tail = j;
+	p->todo_tail = &j->next;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	return TRUE;
+}
+
+/*
+ * worker_pool()
+ *
+ * upvalue 1: Pool
+ *
+ * argument 1: module name
+ * argument 2: number of threads (optional)
+ *
+ * Start threads each loading the module in a Lua state of their
+ * own. Use the pool instead of a function in a method table to
+ * have the function of the module named like the method called
+ * in one of them. The threads see nothing but the module and
+ * the standard libraries, so they can't use upvalues or globals
+ * of the main state.
+ */
+static int simpledbus_worker_pool(lua_State *L)
+{
+	const char *module = luaL_checkstring(L, 1);
+	long n = luaL_optlong(L, 2, sysconf(_SC_NPROCESSORS_ONLN));
+	const char *path;
+	const char *cpath;
+	LPool *p;
+	int err;
+
+	if (n < 1)
+		n = 1;
+
+	lua_settop(L, 2);
+	lua_getglobal(L, "package");
+	lua_getfield(L, 3, "path");
+	lua_getfield(L, 3, "cpath");
+	path = lua_tostring(L, 4);
+	cpath = lua_tostring(L, 5);
+
+	p = lua_newuserdata(L, sizeof(LPool));
+	p->source.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	p->source.handle = pool_handle;
+	p->ctx = get_context(L);
+	p->todo = NULL;
+	p->todo_tail = &p->todo;
+	p->done = NULL;
+	p->done_tail = &p->done;
+	p->quit = 0;
+	p->nworkers = 0;
+	p->workers = malloc(n * sizeof(struct worker));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	/* from now on pool_gc() cleans up */
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+
+	if (p->source.fd < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "Error creating eventfd: %s",
+				strerror(errno));
+		return 2;
+	}
+	if (p->workers == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	while (p->nworkers < (unsigned int)n) {
+		struct worker *w = &p->workers[p->nworkers];
+		lua_State *W = luaL_newstate();
+
+		if (W == NULL) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "Out of memory");
+			return 2;
+		}
+		luaL_openlibs(W);
+
+		/* find modules where the main state finds them */
+		lua_getglobal(W, "package");
+		if (path) {
+			lua_pushstring(W, path);
+			lua_setfield(W, -2, "path");
+		}
+		if (cpath) {
+			lua_pushstring(W, cpath);
+			lua_setfield(W, -2, "cpath");
+		}
+		lua_pop(W, 1);
+
+		lua_getglobal(W, "require");
+		lua_pushstring(W, module);
+		if (lua_pcall(W, 1, 1, 0) || !lua_istable(W, 1)) {
+			lua_pushnil(L);
+			if (lua_isstring(W, 1))
+				lua_pushstring(L, lua_tostring(W, 1));
+			else
+				lua_pushfstring(L, "Module %s didn't return "
+						"a table", module);
+			lua_close(W);
+			return 2;
+		}
+
+		w->L = W;
+		w->pool = p;
+		err = pthread_create(&w->thread, NULL, worker_main, w);
+		if (err) {
+			lua_close(W);
+			lua_pushnil(L);
+			lua_pushfstring(L, "Error starting thread: %s",
+					strerror(err));
+			return 2;
+		}
+		p->nworkers++;
+	}
+
+	source_add(p->ctx, &p->source);
+	return 1;
+}
+
+/*
+ * Pool.__gc()
+ */
+static int pool_gc(lua_State *L)
+{
+	LPool *p = lua_touserdata(L, 1);
+	unsigned int i;
+	struct job *j;
+	struct job *next;
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->nworkers; i++) {
+		pthread_join(p->workers[i].thread, NULL);
+		lua_close(p->workers[i].L);
+	}
+	free(p->workers);
+
+	/* send what was finished and drop the rest */
+	if (p->source.fd >= 0) {
+		source_remove(p->ctx, &p->source);
+		pool_handle(&p->source, L);
+		close(p->source.fd);
+	}
+	for (j = p->todo; j; j = next) {
+		next = j->next;
+		job_free(j);
+	}
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+
+	return 0;
+}
+
+/*
+ * channels carry marshalled messages between Lua states, which
+ * may run on different threads. they are found by name, and
+ * the messages go through a bounded lock-free ring, with an
+ * eventfd to wake the main loops of the receivers
+ */
+struct cell {
+	size_t seq;
+	DBusMessage *msg;
+};
+
+struct channel {
+	struct channel *next;
+	unsigned int refs;
+	int fd;
+	size_t mask;
+	size_t head;
+	size_t tail;
+	struct cell *cells;
+	char name[1];
+};
+
+static struct channel *channels = NULL;
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ring_put(struct channel *ch, DBusMessage *msg)
+{
+	size_t pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	struct cell *cell;
+
+	while (1) {
+		size_t seq;
+		long diff;
+
+		cell = &ch->cells[pos & ch->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ch->head, &pos,
+						pos + 1, 1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return 0; /* full */
+		else
+			pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	}
+
+	cell->msg = msg;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static DBusMessage *ring_get(struct channel *ch)
+{
+	size_t pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+	struct cell *cell;
+	DBusMessage *msg;
+
+	while (1) {
+		size_t seq;
+		long diff;
+
+		cell = &ch->cells[pos & ch->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ch->tail, &pos,
+						pos + 1, 1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return NULL; /* empty */
+		else
+			pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+	}
+
+	msg = cell->msg;
+	__atomic_store_n(&cell->seq, pos + ch->mask + 1, __ATOMIC_RELEASE);
+	return msg;
+}
+
+/*
+ * find the channel called name, or create
+ * it with room for at least size messages
+ */
+static struct channel *channel_get(const char *name, size_t size)
+{
+	struct channel *ch;
+	size_t len;
+	size_t n;
+	size_t i;
+
+	pthread_mutex_lock(&channels_lock);
+	for (ch = channels; ch; ch = ch->next) {
+		if (strcmp(ch->name, name) == 0) {
+			ch->refs++;
+			goto out;
+		}
+	}
+
+	for (n = 2; n < size; n <<= 1);
+
+	len = strlen(name);
+	ch = malloc(sizeof(struct channel) + len);
+	if (ch == NULL)
+		goto out;
+
+	ch->cells = malloc(n * sizeof(struct cell));
+	ch->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ch->cells == NULL || ch->fd < 0) {
+		if (ch->fd >= 0)
+			close(ch->fd);
+		free(ch->cells);
+		free(ch);
+		ch = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		ch->cells[i].seq = i;
+		ch->cells[i].msg = NULL;
+	}
+	ch->mask = n - 1;
+	ch->head = 0;
+	ch->tail = 0;
+	ch->refs = 1;
+	memcpy(ch->name, name, len + 1);
+
+	ch->next = channels;
+	channels = ch;
+out:
+	pthread_mutex_unlock(&channels_lock);
+	return ch;
+}
+
+static void channel_put(struct channel *ch)
+{
+	struct channel **p;
+	DBusMessage *msg;
+
+	pthread_mutex_lock(&channels_lock);
+	if (--ch->refs) {
+		pthread_mutex_unlock(&channels_lock);
+		return;
+	}
+	for (p = &channels; *p != ch; p = &(*p)->next);
+	*p = ch->next;
+	pthread_mutex_unlock(&channels_lock);
+
+	while ((msg = ring_get(ch)))
+		dbus_message_unref(msg);
+	close(ch->fd);
+	free(ch->cells);
+	free(ch);
+}
+
+typedef struct {
+	LSource source;
+	LContext *ctx;
+	struct channel *ch;
+	/* registry reference to ourselves while we have a handler */
+	int ref;
+} LChannel;
+
+static LChannel *channel_check(lua_State *L, int index)
+{
+	int r;
+
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index, "expected a Channel");
+
+	r = lua_compare(L, lua_upvalueindex(1), -1, LUA_OPEQ);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index, "expected a Channel");
+
+	return lua_touserdata(L, index);
+}
+
+/*
+ * run the handler of the channel for everything received
+ */
+static void channel_handle(LSource *s, lua_State *L)
+{
+	LChannel *c = (LChannel *)s;
+	struct channel *ch = c->ch;
+	DBusMessage *msg;
+	uint64_t n;
+
+	(void)read(s->fd, &n, sizeof(n));
+
+	/* keep the channel and its handler on the stack,
+	 * in case the handler lets go of them */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_getuservalue(L, -1);
+	lua_rawgeti(L, -1, 1);
+	lua_replace(L, -2);
+
+	while ((msg = ring_get(ch))) {
+		lua_State *T = lua_newthread(L);
+
+		lua_pushnil(T);
+		lua_pushvalue(L, -2);
+		lua_xmove(L, T, 1);
+
+		resume_thread(c->ctx, T, push_arguments(T, msg));
+		dbus_message_unref(msg);
+
+		if (c->ctx->stop) {
+			/* leave the rest for the next pass */
+			uint64_t one = 1;
+
+			(void)write(ch->fd, &one, sizeof(one));
+			return;
+		}
+		lua_pop(L, 1);
+
+		/* the handler was removed */
+		if (c->ref == LUA_NOREF)
+			break;
+	}
+	lua_pop(L, 2);
+}
+
+/*
+ * channel()
+ *
+ * upvalue 1: Channel
+ *
+ * argument 1: name
+ * argument 2: number of messages it can hold (optional)
+ *
+ * Returns the channel called name, creating it if no Lua state
+ * in the process has it open.
+ */
+static int simpledbus_channel(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	lua_Number size = luaL_optnumber(L, 2, 1024);
+	LChannel *c;
+
+	c = lua_newuserdata(L, sizeof(LChannel));
+	c->ch = channel_get(name, size > 2 ? (size_t)size : 2);
+	if (c->ch == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+	c->source.fd = c->ch->fd;
+	c->source.handle = channel_handle;
+	c->ctx = get_context(L);
+	c->ref = LUA_NOREF;
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+/*
+ * Channel:send()
+ *
+ * upvalue 1: Channel
+ *
+ * argument 1: channel
+ * argument 2: signature
+ * ...
+ */
+static int channel_send(lua_State *L)
+{
+	LChannel *c = channel_check(L, 1);
+	const char *signature = luaL_optstring(L, 2, "");
+	DBusMessage *msg;
+	uint64_t one = 1;
+
+	msg = dbus_message_new(DBUS_MESSAGE_TYPE_SIGNAL);
+	if (msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	if (*signature &&
+			add_arguments(L, 3, lua_gettop(L), signature, msg)) {
+		dbus_message_unref(msg);
+		return lua_error(L);
+	}
+
+	if (!ring_put(c->ch, msg)) {
+		dbus_message_unref(msg);
+		lua_pushnil(L);
+		lua_pushliteral(L, "Channel full");
+		return 2;
+	}
+	(void)write(c->ch->fd, &one, sizeof(one));
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Channel:receive()
+ *
+ * upvalue 1: Channel
+ *
+ * argument 1: channel
+ *
+ * Returns true and the values of the next message,
+ * or false if there is none.
+ */
+static int channel_receive(lua_State *L)
+{
+	LChannel *c = channel_check(L, 1);
+	DBusMessage *msg = ring_get(c->ch);
+	int nargs;
+
+	if (msg == NULL) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	lua_settop(L, 0);
+	lua_pushboolean(L, 1);
+	nargs = push_arguments(L, msg);
+	dbus_message_unref(msg);
+
+	return nargs + 1;
+}
+
+/*
+ * Channel:on_receive()
+ *
+ * upvalue 1: Channel
+ *
+ * argument 1: channel
+ * argument 2: function, or nil
+ *
+ * Run the function with the values of every message received
+ * by the main loop, each in a thread of its own. Several
+ * receivers share the messages between them.
+ */
+static int channel_on_receive(lua_State *L)
+{
+	LChannel *c = channel_check(L, 1);
+
+	lua_settop(L, 2);
+	if (!lua_isnil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	/* the handler lives in the uservalue */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 1);
+	lua_setuservalue(L, 1);
+
+	if (lua_isnil(L, 2)) {
+		if (c->ref != LUA_NOREF) {
+			source_remove(c->ctx, &c->source);
+			luaL_unref(L, LUA_REGISTRYINDEX, c->ref);
+			c->ref = LUA_NOREF;
+		}
+	} else if (c->ref == LUA_NOREF) {
+		uint64_t one = 1;
+
+		lua_pushvalue(L, 1);
+		c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		source_add(c->ctx, &c->source);
+
+		/* messages may be waiting already */
+		(void)write(c->ch->fd, &one, sizeof(one));
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Channel.__gc()
+ */
+static int channel_gc(lua_State *L)
+{
+	LChannel *c = lua_touserdata(L, 1);
+
+	channel_put(c->ch);
+	return 0;
+}
+
+/*
+ * seconds on a clock which doesn't jump
+ */
+static lua_Number monotonic(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (lua_Number)ts.tv_sec + (lua_Number)ts.tv_nsec / 1e9;
+}
+
+/*
+ * answer msg from the reply cached in the method entry
+ * at the top of O, if there is one and it hasn't expired
+ */
+static int cached_reply(LCon *c, DBusMessage *msg, lua_State *O)
+{
+	LReply *r;
+	DBusMessage *reply;
+	int ok = 0;
+
+	lua_rawgeti(O, -1, 4);
+	r = reply_check(O, -1);
+	if (r == NULL) {
+		lua_pop(O, 1);
+		return 0;
+	}
+
+	lua_rawgeti(O, -2, 5);
+	if (lua_isnil(O, -1) || monotonic() < lua_tonumber(O, -1)) {
+		reply = copy_reply(r, msg);
+		/* let the handler run if we're out of memory */
+		if (reply && deliver_reply(c, dbus_message_get_data(msg,
+						loopback_slot), reply))
+			ok = 1;
+	}
+	lua_pop(O, 2);
+
+	return ok;
+}
+
+/*
+ * run the method called by msg in a new thread. O holds the
+ * method table at index 1. methods of fallback handlers get
+ * the path relative to where they were registered first
+ */
+static DBusHandlerResult run_method(DBusConnection *conn,
+		DBusMessage *msg, lua_State *O, const char *relative)
+{
+	LCon *c = dbus_connection_get_data(conn, lcon_slot);
+	uint64_t start = monotonic_ns();
+	struct latency *l;
+	LPool *pool;
+	lua_State *T;
+	int top = lua_gettop(O);
+	int nargs = 0;
+
+#ifdef DEBUG
+	printf("Received message: path = %s,"
+			" interface = %s, member = %s\n",
+			dbus_message_get_path(msg),
+			dbus_message_get_interface(msg),
+			dbus_message_get_member(msg));
+	fflush(stdout);
+#endif
+
+	lua_pushfstring(O, "%s.%s",
+			dbus_message_get_interface(msg),
+			dbus_message_get_member(msg));
+
+	lua_rawget(O, 1);
+	if (!lua_istable(O, top + 1)) {
+		lua_settop(O, top);
+#ifdef DEBUG
+		printf("..not handled\n"); fflush(stdout);
+#endif
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	l = latency_get(c->methods, msg);
+
+	/* cacheable methods keep their last reply at index 4 */
+	if (cached_reply(c, msg, O)) {
+		latency_add(l, start);
+		lua_settop(O, top);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	/* methods run by a worker pool have it instead of a function */
+	lua_rawgeti(O, top + 1, 3);
+	pool = pool_check(O, -1);
+	if (pool) {
+		const char *signature;
+		dbus_bool_t r;
+
+		lua_rawgeti(O, top + 1, 2);
+		signature = lua_tostring(O, -1);
+		r = pool_submit(pool, conn, msg, signature ? signature : "",
+				l, start);
+		lua_settop(O, top);
+		return r ? DBUS_HANDLER_RESULT_HANDLED
+			: DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+	lua_pop(O, 1);
+
+	/* create a new thread to run the method in */
+	T = lua_newthread(O);
+	/* ..and insert it before the function table */
+	lua_insert(O, top + 1);
+	c->stats.threads++;
+
+	/* push the send_reply function */
+	lua_pushcclosure(T, send_reply, 0);
+
+	/* push the connection */
+	lua_pushlightuserdata(T, c);
+
+	/* push the message */
+	dbus_message_ref(msg);
+	lua_pushlightuserdata(T, msg);
+
+	/* move the return signature and the function to T */
+	lua_rawgeti(O, top + 2, 2);
+	lua_rawgeti(O, top + 2, 3);
+	lua_xmove(O, T, 2);
+
+	/* methods with a true value at index 6 want to know the
+	 * connection they were called on, which O keeps after
+	 * the method table and the path of fallbacks */
+	lua_rawgeti(O, top + 2, 6);
+	if (lua_toboolean(O, -1)) {
+		lua_pushvalue(O, relative ? 3 : 2);
+		lua_xmove(O, T, 1);
+		nargs++;
+	}
+
+	/* forget about the function table */
+	lua_settop(O, top + 1);
+
+	if (relative) {
+		lua_pushstring(T, relative);
+		nargs++;
+	}
+
+	switch (lua_resume(T, O, nargs + push_arguments(T, msg))) {
+	case 0: /* thread finished */
+		latency_add(l, start);
+		if (send_reply(T)) {
+			c->stats.handler_errors++;
+			stop_with_error(c->ctx, T);
+		}
+		lua_settop(O, top);
+		break;
+	case LUA_YIELD:	/* thread yielded */
+		/* send_reply() takes the time when it finishes */
+		set_started(msg, l, start);
+		/* forget about the thread */
+		lua_settop(O, top);
+		break;
+	default: /* thread errored */
+		lua_settop(O, top);
+		c->stats.handler_errors++;
+		stop_with_error(c->ctx, T);
+	}
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult method_call_handler(DBusConnection *conn,
+		DBusMessage *msg, lua_State *O)
+{
+	return run_method(conn, msg, O, NULL);
+}
+
+/*
+ * fallback handlers keep the path they
+ * were registered at in O at index 2
+ */
+static DBusHandlerResult fallback_call_handler(DBusConnection *conn,
+		DBusMessage *msg, lua_State *O)
+{
+	const char *path = dbus_message_get_path(msg);
+	size_t len;
+
+	(void)lua_tolstring(O, 2, &len);
+
+	/* "/" is a prefix of everything */
+	if (len == 1)
+		len = 0;
+
+	path += len;
+	if (*path == '/')
+		path++;
+
+	return run_method(conn, msg, O, path);
+}
+
+/*
+ * find the Lua object handling path, either registered
+ * right there or as a fallback somewhere above it
+ */
+static lua_State *find_object(DBusConnection *conn, const char *path)
+{
+	lua_State *O = NULL;
+	size_t len;
+	char *buf;
+
+	if (!dbus_connection_get_object_path_data(conn, path, (void **)&O))
+		return NULL;
+	if (O)
+		return O;
+
+	len = strlen(path);
+	buf = malloc(len + 1);
+	if (buf == NULL)
+		return NULL;
+	memcpy(buf, path, len + 1);
+
+	while (buf[1] != '\0') {
+		char *slash = strrchr(buf, '/');
+
+		if (slash == buf)
+			slash++;
+		*slash = '\0';
+
+		/* fallback handlers have their path at index 2 */
+		if (dbus_connection_get_object_path_data(conn, buf,
+					(void **)&O) && O
+				&& lua_type(O, 2) == LUA_TSTRING)
+			break;
+		O = NULL;
+	}
+	free(buf);
+
+	return O;
+}
+
+static int owns_name(LCon *c, const char *name)
+{
+	const char *unique = dbus_bus_get_unique_name(c->conn);
+	unsigned int i;
+
+	if (unique && strcmp(name, unique) == 0)
+		return 1;
+
+	for (i = 0; i < c->nnames; i++) {
+		if (strcmp(name, c->names[i]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * if msg calls a method of an object we export, run it
+ * directly and return the number of values pushed, or
+ * LOCAL_WAIT if the caller must wait for the reply.
+ * returns -1 and leaves msg alone if it must go
+ * through the bus
+ */
+static int call_local(lua_State *L, LCon *c, DBusMessage *msg,
+		const char *result)
+{
+	const char *destination = dbus_message_get_destination(msg);
+	const char *interface = dbus_message_get_interface(msg);
+	const char *unique;
+	struct loopback *lb;
+	lua_State *O;
+	DBusHandlerResult r;
+	int known;
+
+	if (destination == NULL || interface == NULL
+			|| !owns_name(c, destination))
+		return -1;
+
+	O = find_object(c->conn, dbus_message_get_path(msg));
+	if (O == NULL)
+		return -1;
+
+	/* let the bus report unknown methods */
+	lua_pushfstring(O, "%s.%s", interface,
+			dbus_message_get_member(msg));
+	lua_rawget(O, 1);
+	known = lua_istable(O, -1);
+	lua_pop(O, 1);
+	if (!known)
+		return -1;
+
+	lb = malloc(sizeof(struct loopback));
+	if (lb == NULL)
+		return -1;
+	lb->caller = NULL;
+	lb->call = msg;
+	lb->reply = NULL;
+	lb->latency = NULL;
+	lb->result = NULL;
+	if (!dbus_message_set_data(msg, loopback_slot, lb, free)) {
+		free(lb);
+		return -1;
+	}
+
+	/* make it look like it came through the bus */
+	unique = dbus_bus_get_unique_name(c->conn);
+	if (unique)
+		(void)dbus_message_set_sender(msg, unique);
+	dbus_message_set_serial(msg, 1);
+	c->stats.local_calls++;
+
+	if (lua_type(O, 2) == LUA_TSTRING)
+		r = fallback_call_handler(c->conn, msg, O);
+	else
+		r = method_call_handler(c->conn, msg, O);
+
+	if (r != DBUS_HANDLER_RESULT_HANDLED) {
+		dbus_message_unref(msg);
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	/* the method answered right away */
+	if (lb->reply) {
+		DBusMessage *reply = lb->reply;
+
+		/* this frees lb */
+		dbus_message_unref(msg);
+		return push_checked_reply(L, reply, result);
+	}
+
+	lb->caller = L;
+	return LOCAL_WAIT;
+}
+
+/*
+ * keep track of the names we own, so calls to
+ * them can be handled without going through the bus.
+ * being the first filter it also counts what comes in,
+ * except replies which go straight to their pending call
+ */
+static DBusHandlerResult name_filter(DBusConnection *conn,
+		DBusMessage *msg, LCon *c)
+{
+	const char *name;
+	unsigned int i;
+	int acquired;
+
+	c->stats.received[dbus_message_get_type(msg)]++;
+
+	if (dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS, "NameAcquired"))
+		acquired = 1;
+	else if (dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS, "NameLost"))
+		acquired = 0;
+	else
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (!dbus_message_has_sender(msg, DBUS_SERVICE_DBUS) ||
+			!dbus_message_get_args(msg, NULL,
+				DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	for (i = 0; i < c->nnames; i++) {
+		if (strcmp(name, c->names[i]) == 0)
+			break;
+	}
+
+	if (acquired && i == c->nnames) {
+		char **names = realloc(c->names,
+				(c->nnames + 1) * sizeof(char *));
+
+		if (names) {
+			c->names = names;
+			names[c->nnames] = strdup(name);
+			if (names[c->nnames])
+				c->nnames++;
+		}
+	} else if (!acquired && i < c->nnames) {
+		free(c->names[i]);
+		c->names[i] = c->names[--c->nnames];
+	}
+
+	/* signal handlers may want to see it too */
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static const DBusObjectPathVTable vtable = {
+	NULL, (DBusObjectPathMessageFunction)method_call_handler,
+	NULL, NULL, NULL, NULL
+};
+
+static const DBusObjectPathVTable fallback_vtable = {
+	NULL, (DBusObjectPathMessageFunction)fallback_call_handler,
+	NULL, NULL, NULL, NULL
+};
+
+/*
+ * register an object path or a fallback for a whole subtree
+ *
+ * argument 1: connection
+ * argument 2: path
+ * argument 3: method table
+ */
+static int register_path(lua_State *L, int fallback)
+{
+	LCon *c = bus_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	lua_State *O;
+	dbus_bool_t r;
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	/* drop extra arguments */
+	lua_settop(L, 3);
+
+	/* get the signal/thread table of the conection */
+	lua_getuservalue(L, 1);
+	/* ..and move it before the path */
+	lua_insert(L, 2);
+
+	/* check if we already registered this object path */
+	lua_pushvalue(L, 3);
+	lua_rawget(L, 2);
+	if (lua_isthread(L, 5)) {
+		O = lua_tothread(L, 5);
+		/* fallbacks keep their path at index 2 */
+		if ((lua_type(O, 2) == LUA_TSTRING) != fallback) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "Object path already registered");
+			return 2;
+		}
+		lua_pop(L, 1);
+
+		/* just replace the method table */
+		lua_xmove(L, O, 1);
+		lua_replace(O, 1);
+		/* return true */
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	/* clear result of lua_rawget() */
+	lua_settop(L, 4);
+
+	/* move method table before path */
+	lua_insert(L, 3);
+
+	/* create thread for storing object data */
+	O = lua_newthread(L);
+	if (O == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	/* register the object path */
+	if (fallback)
+		r = dbus_connection_register_fallback(c->conn, path,
+				&fallback_vtable, O);
+	else
+		r = dbus_connection_register_object_path(c->conn, path,
+				&vtable, O);
+	if (!r) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	c->generation++;
+
+	/* save the thread in the thread table */
+	lua_pushvalue(L, 4);
+	lua_pushvalue(L, 5);
+	lua_rawset(L, 2);
+
+	/* move method table, the path for fallbacks
+	 * and the connection to the thread */
+	lua_pushvalue(L, 3);
+	if (fallback) {
+		lua_pushvalue(L, 4);
+		lua_pushvalue(L, 1);
+		lua_xmove(L, O, 3);
+	} else {
+		lua_pushvalue(L, 1);
+		lua_xmove(L, O, 2);
+	}
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Bus:register_object_path()
+ *
+ * argument 1: connection
+ * argument 2: path
+ * argument 3: method table
+ */
+static int bus_register_object_path(lua_State *L)
+{
+	return register_path(L, 0);
+}
+
+/*
+ * Bus:register_fallback()
+ *
+ * argument 1: connection
+ * argument 2: path
+ * argument 3: method table
+ *
+ * Like register_object_path(), but the methods also handle calls
+ * to every object below the path which isn't registered itself.
+ * Each method gets the path relative to the registered one as its
+ * first argument.
+ */
+static int bus_register_fallback(lua_State *L)
+{
+	return register_path(L, 1);
+}
+
+/*
+ * Bus:unregister_object_path()
+ *
+ * argument 1: connection
+ * argument 2: path
+ */
+static int bus_unregister_object_path(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+
+	/* drop extra arguments */
+	lua_settop(L, 2);
+
+	/* get the signal/thread table of the conection */
+	lua_getuservalue(L, 1);
+	/* ..and move it before the path */
+	lua_insert(L, 2);
+
+	lua_pushvalue(L, 3);
+	lua_rawget(L, 2);
+	if (!lua_isthread(L, 4))
+		return luaL_error(L, "Object path not registered");
+	lua_settop(L, 3);
+
+	lua_pushnil(L);
+	if (!dbus_connection_unregister_object_path(c->conn, path)) {
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+	c->generation++;
+
+	lua_rawset(L, 2);
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * an I/O thread reads the socket of a connection, so libdbus
+ * assembles and validates incoming messages off the Lua thread.
+ * it tells the main loop through an eventfd when there is
+ * something to dispatch, and the main loop wakes it through
+ * another one when libdbus has messages it couldn't send
+ */
+struct io_thread {
+	LSource source;
+	LCon *c;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int quit;
+	int socket;
+	int wakeup;
+};
+
+static void io_notify(int fd)
+{
+	uint64_t one = 1;
+
+	(void)write(fd, &one, sizeof(one));
+}
+
+static void io_wakeup_cb(struct io_thread *io)
+{
+	io_notify(io->wakeup);
+}
+
+static void io_handle(LSource *s, lua_State *L)
+{
+	uint64_t n;
+
+	/* dispatchall() does the rest */
+	(void)read(s->fd, &n, sizeof(n));
+}
+
+static void *io_main(void *arg)
+{
+	struct io_thread *io = arg;
+	DBusConnection *conn = io->c->conn;
+	struct pollfd p[2];
+	uint64_t n;
+	int quit;
+
+	p[0].fd = io->socket;
+	p[1].fd = io->wakeup;
+	p[1].events = POLLIN;
+
+	while (1) {
+		pthread_mutex_lock(&io->lock);
+		quit = io->quit;
+		pthread_mutex_unlock(&io->lock);
+		if (quit)
+			break;
+
+		p[0].events = POLLIN;
+		if (dbus_connection_has_messages_to_send(conn))
+			p[0].events |= POLLOUT;
+		p[0].revents = 0;
+		p[1].revents = 0;
+
+		if (poll(p, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (p[1].revents)
+			(void)read(io->wakeup, &n, sizeof(n));
+
+		if (p[0].revents == 0)
+			continue;
+
+		/* read and write whatever the socket lets us. this
+		 * doesn't call the dispatch status function, so look
+		 * for ourselves */
+		if (!dbus_connection_read_write(conn, 0)) {
+			/* disconnected, let the main loop see it */
+			io_notify(io->source.fd);
+			break;
+		}
+		if (dbus_connection_get_dispatch_status(conn)
+				== DBUS_DISPATCH_DATA_REMAINS)
+			io_notify(io->source.fd);
+	}
+
+	return NULL;
+}
+
+static void io_thread_stop(LCon *c)
+{
+	struct io_thread *io = c->io;
+
+	if (io == NULL)
+		return;
+
+	pthread_mutex_lock(&io->lock);
+	io->quit = 1;
+	pthread_mutex_unlock(&io->lock);
+	io_notify(io->wakeup);
+	pthread_join(io->thread, NULL);
+
+	dbus_connection_set_wakeup_main_function(c->conn,
+			NULL, NULL, NULL);
+
+	source_remove(c->ctx, &io->source);
+	close(io->source.fd);
+	close(io->wakeup);
+	pthread_mutex_destroy(&io->lock);
+	free(io);
+
+	c->io = NULL;
+	/* the main loop polls the watches again */
+	c->watches_changed = 1;
+}
+
+/*
+ * Bus:start_io_thread()
+ *
+ * argument 1: connection
+ *
+ * Read the connection in a thread of its own. The main loop
+ * then only dispatches what the thread has read. Blocking
+ * method calls outside the main loop aren't possible until
+ * stop_io_thread() is called.
+ */
+static int bus_start_io_thread(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	struct io_thread *io;
+	int err;
+
+	if (c->io) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	io = malloc(sizeof(struct io_thread));
+	if (io == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	if (!dbus_connection_get_socket(c->conn, &io->socket)) {
+		free(io);
+		lua_pushnil(L);
+		lua_pushliteral(L, "Connection has no socket");
+		return 2;
+	}
+
+	io->source.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	io->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (io->source.fd < 0 || io->wakeup < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "Error creating eventfd: %s",
+				strerror(errno));
+		if (io->source.fd >= 0)
+			close(io->source.fd);
+		if (io->wakeup >= 0)
+			close(io->wakeup);
+		free(io);
+		return 2;
+	}
+	io->source.handle = io_handle;
+	io->c = c;
+	io->quit = 0;
+	pthread_mutex_init(&io->lock, NULL);
+
+	dbus_connection_set_wakeup_main_function(c->conn,
+			(DBusWakeupMainFunction)io_wakeup_cb, io, NULL);
+
+	/* the main loop stops polling the watches from here */
+	c->io = io;
+
+	err = pthread_create(&io->thread, NULL, io_main, io);
+	if (err) {
+		c->io = NULL;
+		dbus_connection_set_wakeup_main_function(c->conn,
+				NULL, NULL, NULL);
+		close(io->source.fd);
+		close(io->wakeup);
+		pthread_mutex_destroy(&io->lock);
+		free(io);
+		lua_pushnil(L);
+		lua_pushfstring(L, "Error starting thread: %s",
+				strerror(err));
+		return 2;
+	}
+
+	source_add(c->ctx, &io->source);
+
+	/* something may have been read already */
+	if (dbus_connection_get_dispatch_status(c->conn)
+			== DBUS_DISPATCH_DATA_REMAINS)
+		io_notify(io->source.fd);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Bus:stop_io_thread()
+ *
+ * argument 1: connection
+ */
+static int bus_stop_io_thread(lua_State *L)
+{
+	io_thread_stop(bus_check(L, 1));
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Bus:pending()
+ *
+ * argument 1: connection
+ *
+ * Returns the number of method calls waiting for a reply.
+ */
+static int bus_pending(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+
+	lua_pushnumber(L, (lua_Number)c->npending);
+	return 1;
+}
+
+#define set_stats_field(L, name, value) \
+do { \
+	lua_pushnumber(L, (lua_Number)(value)); \
+	lua_setfield(L, -2, name); \
+} while (0)
+
+/*
+ * push a table of message counters indexed by message type
+ */
+static void push_type_counters(lua_State *L, unsigned long *counters)
+{
+	int type;
+
+	lua_createtable(L, 0, DBUS_NUM_MESSAGE_TYPES - 1);
+	for (type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+			type < DBUS_NUM_MESSAGE_TYPES; type++) {
+		lua_pushnumber(L, (lua_Number)counters[type]);
+		lua_setfield(L, -2, dbus_message_type_to_string(type));
+	}
+}
+
+/*
+ * Bus:stats()
+ *
+ * argument 1: connection
+ *
+ * Returns a table of counters kept since the connection
+ * was opened:
+ *   sent, received: messages by type, ie. method_call,
+ *     method_return, error and signal
+ *   local_calls: method calls to our own objects which
+ *     didn't go through the bus
+ *   dispatches: main loop passes with messages to dispatch
+ *   watch_rebuilds: times the main loop rebuilt its poll set
+ *     because the watches of the connection changed
+ *   threads: threads created to run handlers
+ *   handler_errors: handlers, and threads resumed with a
+ *     method reply, which stopped the main loop with an error
+ * and the current state of the connection:
+ *   pending: method calls waiting for a reply
+ *   queued: messages held back by cork()
+ *   outgoing: bytes libdbus has yet to write
+ */
+static int bus_stats(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+
+	lua_createtable(L, 0, 11);
+
+	push_type_counters(L, c->stats.sent);
+	lua_setfield(L, -2, "sent");
+	push_type_counters(L, c->stats.received);
+	lua_setfield(L, -2, "received");
+
+	set_stats_field(L, "local_calls", c->stats.local_calls);
+	set_stats_field(L, "dispatches", c->stats.dispatches);
+	set_stats_field(L, "watch_rebuilds", c->stats.watch_rebuilds);
+	set_stats_field(L, "threads", c->stats.threads);
+	set_stats_field(L, "handler_errors", c->stats.handler_errors);
+
+	set_stats_field(L, "pending", c->npending);
+	set_stats_field(L, "queued", c->nqueued);
+	set_stats_field(L, "outgoing",
+			dbus_connection_get_outgoing_size(c->conn));
+
+	return 1;
+}
+
+/*
+ * the time in the middle of bucket i
+ */
+static uint64_t latency_bucket_time(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < LAT_SUB)
+		return i;
+
+	shift = i / LAT_SUB - 1;
+	return ((uint64_t)(i - shift * LAT_SUB) << shift)
+		+ ((uint64_t)1 << shift) / 2;
+}
+
+/*
+ * the time at or below which the fraction q of the times fall
+ */
+static uint64_t latency_percentile(struct latency *l, double q)
+{
+	double x = q * (double)l->count;
+	uint64_t rank = (uint64_t)x;
+	uint64_t seen = 0;
+	uint64_t t;
+	unsigned int i;
+
+	if (rank < x || rank == 0)
+		rank++;
+
+	for (i = 0; i < LAT_BUCKETS - 1; i++) {
+		seen += l->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	t = latency_bucket_time(i);
+	if (t < l->min)
+		return l->min;
+	if (t > l->max)
+		return l->max;
+	return t;
+}
+
+/*
+ * push a table of the histograms in table with at least
+ * one time counted, and clear them if reset is set
+ */
+static void push_latencies(lua_State *L, struct latency **table, int reset)
+{
+	unsigned int i;
+	struct latency *l;
+
+	lua_newtable(L);
+	for (i = 0; i < LAT_HASH; i++) {
+		for (l = table[i]; l; l = l->next) {
+			if (l->count == 0)
+				continue;
+
+			lua_createtable(L, 0, 7);
+			set_stats_field(L, "count", l->count);
+			set_stats_field(L, "min", l->min / 1e9);
+			set_stats_field(L, "mean",
+					(double)l->sum / l->count / 1e9);
+			set_stats_field(L, "max", l->max / 1e9);
+			set_stats_field(L, "p50",
+					latency_percentile(l, 0.5) / 1e9);
+			set_stats_field(L, "p99",
+					latency_percentile(l, 0.99) / 1e9);
+			set_stats_field(L, "p999",
+					latency_percentile(l, 0.999) / 1e9);
+			lua_setfield(L, -2, l->key);
+
+			if (reset) {
+				l->count = 0;
+				l->sum = 0;
+				l->min = UINT64_MAX;
+				l->max = 0;
+				memset(l->buckets, 0, sizeof(l->buckets));
+			}
+		}
+	}
+}
+
+/*
+ * Bus:latency_report()
+ *
+ * argument 1: connection
+ * argument 2: reset (optional)
+ *
+ * Returns a table with the round trip times of method calls
+ * made on the connection under "calls", and the time taken by
+ * the methods it exports under "methods", both indexed by
+ * "interface.member". For each there is the count and the min,
+ * mean, max, p50, p99 and p999 times in seconds. Percentiles
+ * are accurate to about 3%. If reset is true the times are
+ * cleared afterwards.
+ */
+static int bus_latency_report(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	int reset = lua_toboolean(L, 2);
+
+	lua_createtable(L, 0, 2);
+	push_latencies(L, c->calls, reset);
+	lua_setfield(L, -2, "calls");
+	push_latencies(L, c->methods, reset);
+	lua_setfield(L, -2, "methods");
+
+	return 1;
+}
+
+/*
+ * Bus:close()
+ *
+ * argument 1: connection
+ *
+ * Close a private connection. The main loop lets go of it
+ * once the messages already received are dispatched.
+ */
+static int bus_close(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+
+	if (!c->private)
+		return luaL_error(L, "Only private connections can be closed");
+
+	io_thread_stop(c);
+	(void)flush_queue(c);
+	dbus_connection_flush(c->conn);
+	dbus_connection_close(c->conn);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * DBus.__gc()
+ */
+static int bus_gc(lua_State *L)
+{
+	LCon *c = lua_touserdata(L, 1);
+
+	io_thread_stop(c);
+
+	/* send whatever is still corked */
+	(void)flush_queue(c);
+	free(c->queue);
+
+	dbus_connection_remove_filter(c->conn,
+			(DBusHandleMessageFunction)name_filter, c);
+	while (c->nnames)
+		free(c->names[--c->nnames]);
+	free(c->names);
+
+	latency_free(c->calls);
+	latency_free(c->methods);
+
+	/* shared connections live on, but not our timers */
+	(void)dbus_connection_set_timeout_functions(c->conn,
+			NULL, NULL, NULL, NULL, NULL);
+
+	dbus_connection_set_data(c->conn, lcon_slot, NULL, NULL);
+	if (c->private) {
+		dbus_connection_flush(c->conn);
+		dbus_connection_close(c->conn);
+	}
+	dbus_connection_unref(c->conn);
+
+	return 0;
+}
+
+/*
+ * mainloop()
+ */
+static struct pollfd *make_poll_struct(LContext *ctx,
+		int n, LCon **c, nfds_t *nfds)
+{
+	struct pollfd *p;
+	struct pollfd *fds;
+	nfds_t total = 0;
+	int i;
+	DBusWatch *watch;
+	LSource *s;
+
+	for (i = 0; i < n; i++) {
+		if (c[i]->io == NULL)
+			total += c[i]->nactive;
+	}
+	for (s = ctx->sources; s; s = s->next)
+		total++;
+	*nfds = total;
+
+	fds = malloc(total * sizeof(struct pollfd));
+	if (fds == NULL)
+		return NULL;
+
+	p = fds;
+	for (i = 0; i < n; i++) {
+		/* the I/O thread polls those */
+		if (c[i]->io)
+			continue;
+
+		for (watch = c[i]->active; watch;
+				watch = dbus_watch_get_data(watch)) {
+			unsigned int flags = dbus_watch_get_flags(watch);
+
+			p->fd = dbus_watch_get_unix_fd(watch);
+			p->events = POLLERR | POLLHUP;
+			p->revents = 0;
+
+			if (flags & DBUS_WATCH_READABLE)
+				p->events |= POLLIN;
+			if (flags & DBUS_WATCH_WRITABLE)
+				p->events |= POLLOUT;
+
+			p++;
+		}
+
+		if (c[i]->watches_changed) {
+			c[i]->stats.watch_rebuilds++;
+			c[i]->watches_changed = 0;
+		}
+	}
+
+	/* the other sources go last */
+	for (s = ctx->sources; s; s = s->next) {
+		p->fd = s->fd;
+		p->events = POLLIN;
+		p->revents = 0;
+		p++;
+	}
+	ctx->sources_changed = 0;
+
+	return fds;
+}
+
+static inline unsigned int dispatchall(int n, LCon **c)
+{
+	unsigned int r = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		DBusConnection *conn = c[i]->conn;
+
+		if (dbus_connection_get_dispatch_status(conn)
+				== DBUS_DISPATCH_DATA_REMAINS) {
+			c[i]->stats.dispatches++;
+			while (dbus_connection_dispatch(conn)
+					== DBUS_DISPATCH_DATA_REMAINS);
+		}
+
+		/* send everything corked during this pass */
+		if (c[i]->nqueued)
+			(void)flush_queue(c[i]);
+
+		if (c[i]->io == NULL)
+			r |= c[i]->watches_changed;
+	}
+
+	return r;
+}
+
+/*
+ * returns true if a connection has messages queued since it was
+ * last dispatched, fx. when it was closed by a handler. then
+ * the main loop must not wait for anything new to happen
+ */
+static inline int data_remains(int n, LCon **c)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (dbus_connection_get_dispatch_status(c[i]->conn)
+				!= DBUS_DISPATCH_COMPLETE)
+			return 1;
+	}
+
+	return 0;
+}
+
+static inline void handleall(lua_State *L, LContext *ctx,
+		int n, LCon **c, struct pollfd *p)
+{
+	int i;
+	DBusWatch *watch;
+	LSource *s;
+	LSource *next;
+
+	for (i = 0; i < n; i++) {
+		if (c[i]->io)
+			continue;
+
+		for (watch = c[i]->active; watch;
+				watch = dbus_watch_get_data(watch)) {
+			if (p->revents) {
+				unsigned int flags = 0;
+
+				if (p->revents & POLLIN)
+					flags |= DBUS_WATCH_READABLE;
+				if (p->revents & POLLOUT)
+					flags |= DBUS_WATCH_WRITABLE;
+				if (p->revents & POLLERR)
+					flags |= DBUS_WATCH_ERROR;
+				if (p->revents & POLLHUP)
+					flags |= DBUS_WATCH_HANGUP;
+
+				(void)dbus_watch_handle(watch, flags);
+				p->revents = 0;
+			}
+			p++;
+		}
+	}
+
+	for (s = ctx->sources; s; s = next) {
+		next = s->next;
+		if (p->revents) {
+			p->revents = 0;
+			s->handle(s, L);
+			/* poll again before looking at the
+			 * rest if the handler changed them */
+			if (ctx->sources_changed || ctx->stop)
+				break;
+		}
+		p++;
+	}
+}
+
+/*
+ * run the functions given to defer() since the last pass
+ * of the main loop, each in a thread of its own
+ */
+static void run_deferred(LContext *ctx, lua_State *L, int index)
+{
+	int n = lua_rawlen(L, index);
+	int i;
+
+	if (n == 0 || ctx->stop || !lua_checkstack(L, n + 2))
+		return;
+
+	/* take them out first, so functions
+	 * deferred now are run on the next pass */
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, index, i);
+		lua_pushnil(L);
+		lua_rawseti(L, index, i);
+	}
+
+	for (i = -n; i < 0; i++) {
+		lua_State *T = lua_newthread(L);
+
+		lua_pushnil(T);
+		lua_pushvalue(L, i - 1);
+		lua_xmove(L, T, 1);
+
+		resume_thread(ctx, T, 0);
+		/* leave what stop() or an error put on
+		 * top of the stack for the main loop */
+		if (ctx->stop)
+			return;
+
+		lua_pop(L, 1);
+	}
+	lua_pop(L, n);
+}
+
+/*
+ * run the connection at index from the main loop until
+ * it is closed, even if it isn't passed to mainloop()
+ */
+static void attach_connection(lua_State *L, LContext *ctx, int index)
+{
+	LCon *c = lua_touserdata(L, index);
+
+	if (c->ref != LUA_NOREF)
+		return;
+
+	lua_pushvalue(L, index);
+	c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	c->next = ctx->attached;
+	ctx->attached = c;
+	ctx->attached_changed = 1;
+}
+
+/*
+ * let go of attached connections which are closed and have
+ * nothing more to dispatch. if the list of them changed, make
+ * a new array of the n connections given to mainloop()
+ * followed by the attached ones and return 1
+ */
+static int update_connections(lua_State *L, LContext *ctx,
+		int n, LCon ***c, int *total)
+{
+	LCon **p;
+	LCon **new;
+	LCon *a;
+	int i;
+
+	for (p = &ctx->attached; (a = *p);) {
+		if (dbus_connection_get_is_connected(a->conn) ||
+				dbus_connection_get_dispatch_status(a->conn)
+				!= DBUS_DISPATCH_COMPLETE) {
+			p = &a->next;
+			continue;
+		}
+
+		*p = a->next;
+		a->next = NULL;
+		luaL_unref(L, LUA_REGISTRYINDEX, a->ref);
+		a->ref = LUA_NOREF;
+		ctx->attached_changed = 1;
+	}
+
+	if (!ctx->attached_changed)
+		return 0;
+
+	i = n + 1;
+	for (a = ctx->attached; a; a = a->next)
+		i++;
+
+	new = realloc(*c, i * sizeof(LCon *));
+	if (new == NULL)
+		return -1;
+	*c = new;
+
+	i = n;
+	for (a = ctx->attached; a; a = a->next) {
+		int j;
+
+		/* it may be given to mainloop() too */
+		for (j = 0; j < n && new[j] != a; j++);
+		if (j == n)
+			new[i++] = a;
+	}
+	*total = i;
+	ctx->attached_changed = 0;
+
+	return 1;
+}
+
+static int simpledbus_mainloop(lua_State *L)
+{
+	LContext *ctx = get_context(L);
+	LCon **c;
+	struct pollfd *fds = NULL;
+	nfds_t nfds;
+	int i;
+	int n = lua_gettop(L);
+	int nc;
+
+	if (ctx->main)
+		return luaL_error(L, "Another main loop is already running");
+
+	if (lua_isfunction(L, n))
+		n--;
+
+	if (n < 1 && ctx->attached == NULL && ctx->sources == NULL)
+		return luaL_error(L, "At least 1 DBus connection required");
+
+	c = malloc((n + 1) * sizeof(LCon *));
+	if (c == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	for (i = 0; i < n; i++) {
+		/* don't use bus_check() so we can free c
+		 * before erroring
+		c[i] = bus_check(L, i+1);
+		*/
+		int r;
+
+		if (lua_getmetatable(L, i+1) == 0) {
+			free(c);
+			return luaL_argerror(L, i+1,
+					"expected a DBus connection");
+		}
+
+		r = lua_compare(L, lua_upvalueindex(1), -1, LUA_OPEQ);
+		lua_pop(L, 1);
+		if (r == 0) {
+			free(c);
+			return luaL_argerror(L, i+1,
+					"expected a DBus connection");
+		}
+
+		c[i] = lua_touserdata(L, i+1);
+	}
+
+	nc = n;
+	ctx->attached_changed = 1;
+	if (update_connections(L, ctx, n, &c, &nc) < 0)
+		goto oom;
+
+	fds = make_poll_struct(ctx, nc, c, &nfds);
+	if (fds == NULL)
+		goto oom;
+
+	ctx->stop = 0;
+	ctx->main = L;
+
+	/* read, write, dispatch until we get a break */
+	while (1) {
+		unsigned int watches_changed;
+		int r;
+
+		r = update_connections(L, ctx, n, &c, &nc);
+		if (r < 0)
+			goto oom;
+		watches_changed = dispatchall(nc, c) | r;
+
+		run_deferred(ctx, L, lua_upvalueindex(2));
+
+		if (ctx->stop)
+			goto exit;
+
+		r = update_connections(L, ctx, n, &c, &nc);
+		if (r < 0)
+			goto oom;
+
+		if (watches_changed || r || ctx->sources_changed) {
+			free(fds);
+			fds = make_poll_struct(ctx, nc, c, &nfds);
+			if (fds == NULL)
+				goto oom;
+		}
+		r = poll(fds, nfds, 0);
+		if (r < 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "Error polling DBus: %s",
+					strerror(errno));
+			ctx->stop = 2;
+			goto exit;
+		}
+		if (r == 0)
+			break;
+
+		handleall(L, ctx, nc, c, fds);
+	}
+
+	/* if the last argument was a function,
+	 * start it in a new thread */
+	if (n < lua_gettop(L)) {
+		lua_State *T = lua_newthread(L);
+		lua_insert(L, n+1);
+		lua_xmove(L, T, 1);
+
+		switch (lua_resume(T, L, 0)) {
+		case 0: /* thread finished */
+		case LUA_YIELD:	/* thread yielded */
+			/* keep what stop() put on top */
+			if (ctx->stop)
+				goto exit;
+			/* forget about the thread */
+			lua_settop(L, n);
+			break;
+		default: /* thread errored */
+			/* move error message to main thread */
+			lua_xmove(T, L, 1);
+			ctx->stop = -1;
+			goto exit;
+		}
+	}
+
+	/* now run the real main loop */
+	while (1) {
+		unsigned int watches_changed;
+		int r;
+
+		r = update_connections(L, ctx, n, &c, &nc);
+		if (r < 0)
+			goto oom;
+		watches_changed = dispatchall(nc, c) | r;
+
+		run_deferred(ctx, L, lua_upvalueindex(2));
+
+		if (ctx->stop)
+			break;
+
+		r = update_connections(L, ctx, n, &c, &nc);
+		if (r < 0)
+			goto oom;
+
+		if (watches_changed || r || ctx->sources_changed) {
+			free(fds);
+			fds = make_poll_struct(ctx, nc, c, &nfds);
+			if (fds == NULL)
+				goto oom;
+		}
+
+		/* every attached connection is closed
+		 * and there is nothing else to wait for */
+		if (nc == 0 && ctx->sources == NULL) {
+			lua_pushboolean(L, 1);
+			ctx->stop = 1;
+			break;
+		}
+
+		if (poll(fds, nfds, data_remains(nc, c) ? 0
+					: next_timeout(ctx)) < 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "Error polling DBus: %s",
+					strerror(errno));
+			ctx->stop = 2;
+			break;
+		}
+		run_timeouts(ctx);
+		handleall(L, ctx, nc, c, fds);
+	}
+
+exit:
+	free(c);
+	free(fds);
+
+	ctx->main = NULL;
+
+	if (ctx->stop < 0)
+		return lua_error(L);
+
+	return ctx->stop;
+
+oom:
+	free(c);
+	free(fds);
+
+	ctx->main = NULL;
+
+	lua_pushnil(L);
+	lua_pushliteral(L, "Out of memory");
+	return 2;
+}
+
+/*
+ * clock()
+ *
+ * Returns seconds from a monotonic clock.
+ */
+static int simpledbus_clock(lua_State *L)
+{
+	lua_pushnumber(L, monotonic());
+	return 1;
+}
+
+/*
+ * memfd()
+ *
+ * argument 1: string
+ * argument 2: name (optional)
+ *
+ * Returns the file descriptor of a sealed memory file holding
+ * the string. Send it with type 'h' instead of the string itself,
+ * so large payloads don't go through the bus, and close it after.
+ */
+static int simpledbus_memfd(lua_State *L)
+{
+#ifdef MFD_ALLOW_SEALING
+	size_t len;
+	const char *data = luaL_checklstring(L, 1, &len);
+	const char *name = luaL_optstring(L, 2, "simpledbus");
+	int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	int err;
+
+	if (fd < 0)
+		goto error;
+
+	while (len > 0) {
+		ssize_t r = write(fd, data, len);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error_close;
+		}
+		data += r;
+		len -= r;
+	}
+
+	/* the receiver can trust it won't change under its feet */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+				| F_SEAL_WRITE | F_SEAL_SEAL))
+		goto error_close;
+
+	lua_pushnumber(L, (lua_Number)fd);
+	return 1;
+
+error_close:
+	err = errno;
+	close(fd);
+	errno = err;
+error:
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error creating memfd: %s", strerror(errno));
+	return 2;
+#else
+	lua_pushnil(L);
+	lua_pushliteral(L, "Sealed memory files not supported");
+	return 2;
+#endif
+}
+
+/*
+ * close()
+ *
+ * argument 1: file descriptor
+ *
+ * Close a file descriptor, fx. one received as type 'h'.
+ */
+static int simpledbus_close(lua_State *L)
+{
+	int fd = (int)luaL_checknumber(L, 1);
+
+	if (close(fd)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "Error closing file descriptor: %s",
+				strerror(errno));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+typedef struct {
+	const char *data;
+	size_t len;
+} LMapping;
+
+static LMapping *mapping_check(lua_State *L, int index)
+{
+	int r;
+
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index, "expected a Mapping");
+
+	r = lua_compare(L, lua_upvalueindex(1), -1, LUA_OPEQ);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index, "expected a Mapping");
+
+	return lua_touserdata(L, index);
+}
+
+/*
+ * mmap()
+ *
+ * upvalue 1: Mapping
+ *
+ * argument 1: file descriptor
+ *
+ * Map the file read-only. The file must be a memory file
+ * sealed against writing, growing and shrinking, as made by
+ * memfd(). The file descriptor may be closed when this returns.
+ */
+static int simpledbus_mmap(lua_State *L)
+{
+	int fd = (int)luaL_checknumber(L, 1);
+	struct stat st;
+	LMapping *m;
+#ifdef F_GET_SEALS
+	int seals;
+#endif
+
+	if (fstat(fd, &st))
+		goto error;
+
+#ifdef F_GET_SEALS
+	/* don't get killed by SIGBUS if the sender truncates it,
+	 * or see the contents change under us */
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE))
+			!= (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)) {
+#endif
+		lua_pushnil(L);
+		lua_pushliteral(L, "Memory file not sealed");
+		return 2;
+#ifdef F_GET_SEALS
+	}
+#endif
+
+	m = lua_newuserdata(L, sizeof(LMapping));
+	m->data = NULL;
+	m->len = 0;
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+
+	if (st.st_size > 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ,
+				MAP_PRIVATE, fd, 0);
+
+		if (p == MAP_FAILED)
+			goto error;
+
+		m->data = p;
+		m->len = st.st_size;
+	}
+
+	return 1;
+
+error:
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error mapping file: %s", strerror(errno));
+	return 2;
+}
+
+/*
+ * Mapping:sub()
+ *
+ * upvalue 1: Mapping
+ *
+ * argument 1: mapping
+ * argument 2: start (optional)
+ * argument 3: end (optional)
+ *
+ * Returns the bytes from start to end like string.sub(),
+ * or everything if they are left out.
+ */
+static int mapping_sub(lua_State *L)
+{
+	LMapping *m = mapping_check(L, 1);
+	lua_Number len = (lua_Number)m->len;
+	lua_Number i = luaL_optnumber(L, 2, 1);
+	lua_Number j = luaL_optnumber(L, 3, -1);
+
+	if (i < 0)
+		i += len + 1;
+	if (j < 0)
+		j += len + 1;
+	if (i < 1)
+		i = 1;
+	if (j > len)
+		j = len;
+
+	if (i > j)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, m->data + (size_t)i - 1, (size_t)(j - i + 1));
+
+	return 1;
+}
+
+/*
+ * Mapping.__len()
+ */
+static int mapping_len(lua_State *L)
+{
+	LMapping *m = mapping_check(L, 1);
+
+	lua_pushnumber(L, (lua_Number)m->len);
+	return 1;
+}
+
+/*
+ * Mapping:unmap()
+ *
+ * upvalue 1: Mapping
+ *
+ * argument 1: mapping
+ *
+ * Unmap the file now instead of when the
+ * mapping is garbage collected.
+ */
+static int mapping_unmap(lua_State *L)
+{
+	LMapping *m = mapping_check(L, 1);
+
+	if (m->data)
+		munmap((void *)m->data, m->len);
+	m->data = NULL;
+	m->len = 0;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Mapping.__gc()
+ */
+static int mapping_gc(lua_State *L)
+{
+	LMapping *m = lua_touserdata(L, 1);
+
+	if (m->data)
+		munmap((void *)m->data, m->len);
+
+	return 0;
+}
+
+/*
+ * stop()
+ */
+static int simpledbus_stop(lua_State *L)
+{
+	LContext *ctx = get_context(L);
+
+	if (ctx->main == NULL)
+		return luaL_error(L, "Main loop not running");
+
+	ctx->stop = lua_gettop(L);
+
+	if (ctx->stop == 0) {
+		lua_pushboolean(L, 1);
+		ctx->stop = 1;
+	}
+
+	lua_checkstack(ctx->main, ctx->stop);
+
+	lua_xmove(L, ctx->main, ctx->stop);
+
+	return 0;
+}
+
+/*
+ * running()
+ *
+ * Returns true while the main loop is running.
+ */
+static int simpledbus_running(lua_State *L)
+{
+	lua_pushboolean(L, get_context(L)->main != NULL);
+	return 1;
+}
+
+/*
+ * wait()
+ *
+ * upvalue 1: table of waiting threads
+ */
+static int simpledbus_wait(lua_State *L)
+{
+	if (get_context(L)->main == NULL)
+		return luaL_error(L, "Main loop not running");
+
+	if (lua_pushthread(L))
+		return luaL_error(L, "Can't wait in the main thread");
+
+	/* save the thread in the waiting table */
+	lua_pushboolean(L, 1);
+	lua_rawset(L, lua_upvalueindex(1));
+
+	/* ..and sleep until someone calls wake() */
+	return lua_yield(L, 0);
+}
+
+/*
+ * wake()
+ *
+ * upvalue 1: table of waiting threads
+ *
+ * argument 1: thread
+ * ...
+ */
+static int simpledbus_wake(lua_State *L)
+{
+	int nargs = lua_gettop(L) - 1;
+	lua_State *T;
+
+	luaL_checktype(L, 1, LUA_TTHREAD);
+	T = lua_tothread(L, 1);
+
+	/* check that the thread is waiting */
+	lua_pushvalue(L, 1);
+	lua_rawget(L, lua_upvalueindex(1));
+	if (lua_isnil(L, -1))
+		return luaL_argerror(L, 1, "thread not waiting");
+	lua_pop(L, 1);
+
+	/* remove it from the waiting table */
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, lua_upvalueindex(1));
+
+	if (!lua_checkstack(T, nargs))
+		return luaL_error(L, "Out of memory");
+
+	/* move the arguments to the thread and run it */
+	lua_xmove(L, T, nargs);
+	resume_thread(get_context(L), T, nargs);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * defer()
+ *
+ * upvalue 1: table of deferred functions
+ *
+ * argument 1: function
+ *
+ * Run the function in a thread of its own once the main loop
+ * has dispatched everything it has read. Use it to batch up
+ * work caused by many messages arriving together.
+ */
+static int simpledbus_defer(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+
+	lua_rawseti(L, lua_upvalueindex(1),
+			lua_rawlen(L, lua_upvalueindex(1)) + 1);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * spawn()
+ *
+ * argument 1: function
+ * ...
+ *
+ * Run the function in a new thread. Unlike coroutines started
+ * from Lua, such threads can call methods asynchronously and
+ * wait() while the main loop is running.
+ */
+static int simpledbus_spawn(lua_State *L)
+{
+	LContext *ctx = get_context(L);
+	int nargs = lua_gettop(L) - 1;
+	lua_State *T;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	T = lua_newthread(L);
+	if (!lua_checkstack(T, nargs + 2))
+		return luaL_error(L, "Out of memory");
+	/* ..and keep it below the function */
+	lua_insert(L, 1);
+
+	/* no reply to send when the thread finishes */
+	lua_pushnil(T);
+	lua_xmove(L, T, nargs + 1);
+
+	if (ctx->main) {
+		resume_thread(ctx, T, nargs);
+		return 1;
+	}
+
+	/* no main loop, so the thread just runs to the end
+	 * doing blocking calls and we report errors here */
+	switch (lua_resume(T, L, nargs)) {
+	case 0:
+	case LUA_YIELD:
+		break;
+	default:
+		lua_xmove(T, L, 1);
+		return lua_error(L);
+	}
+
+	return 1;
+}
+
+/*
+ * push a Bus for conn. returns 0 and pushes nothing if conn
+ * is a shared connection used by another Lua state, so the
+ * caller can get a private connection instead
+ */
+static int new_connection(lua_State *L, DBusConnection *conn,
+		DBusError *err, int private)
+{
+	LCon *c;
+	lua_State *S;
+	int claimed;
+
+	if (dbus_error_is_set(err)) {
+		lua_pushnil(L);
+		lua_pushstring(L, err->message);
+		dbus_error_free(err);
+		return 2;
+	}
+
+	if (conn == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Couldn't create connection");
+		return 2;
+	}
+
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+
+	lua_pushlightuserdata(L, conn);
+	lua_rawget(L, lua_upvalueindex(2)); /* connection table */
+	if (lua_type(L, -1) == LUA_TUSERDATA) {
+		dbus_connection_unref(conn);
+		return 1;
+	}
+	lua_pop(L, 1);
+
+	if (dbus_connection_get_data(conn, lcon_slot) != NULL) {
+		dbus_connection_unref(conn);
+		return 0;
+	}
+
+	lua_settop(L, 0);
+
+	/* create new userdata for the bus */
+	c = lua_newuserdata(L, sizeof(LCon));
+	if (c == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+	c->conn = conn;
+	c->watches_changed = 0;
+	c->nactive = 0;
+	c->active = NULL;
+	c->corked = 0;
+	c->nqueued = 0;
+	c->queue_size = 0;
+	c->queue = NULL;
+	c->serial = FLUSH_SERIAL;
+	c->batch_max = -1;
+	c->generation = 0;
+	c->ctx = get_context(L);
+	c->private = private;
+	c->io = NULL;
+	c->npending = 0;
+	c->nnames = 0;
+	c->names = NULL;
+	memset(&c->stats, 0, sizeof(c->stats));
+	memset(c->calls, 0, sizeof(c->calls));
+	memset(c->methods, 0, sizeof(c->methods));
+	c->next = NULL;
+	c->ref = LUA_NOREF;
+
+	/* let handlers find the connection. other Lua states
+	 * on other threads may be trying to claim it too */
+	pthread_mutex_lock(&claim_lock);
+	if (dbus_connection_get_data(conn, lcon_slot) != NULL)
+		claimed = 0;
+	else if (dbus_connection_set_data(conn, lcon_slot, c, NULL))
+		claimed = 1;
+	else
+		claimed = -1;
+	pthread_mutex_unlock(&claim_lock);
+
+	if (claimed <= 0) {
+		if (private)
+			dbus_connection_close(conn);
+		dbus_connection_unref(conn);
+		lua_pushnil(L);
+		if (claimed == 0)
+			lua_pushliteral(L, "Connection used by another Lua state");
+		else
+			lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	/* set the metatable */
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, 1);
+
+	/* create new environment table for
+	 * signal handlers and running threads */
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 2);
+	lua_setuservalue(L, 1);
+
+	/* create thread for signal handler */
+	S = lua_newthread(L);
+	if (S == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+	/* ..and save it */
+	lua_rawseti(L, 2, 1);
+
+	/* create signal table */
+	lua_newtable(L);
+	/* ..save it */
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, 2, 2);
+	/* ..and move it to the thread */
+	lua_xmove(L, S, 1);
+
+	/* set watch functions */
+	if (!dbus_connection_set_watch_functions(conn,
+				(DBusAddWatchFunction)add_watch_cb,
+				(DBusRemoveWatchFunction)remove_watch_cb,
+				(DBusWatchToggledFunction)toggle_watch_cb,
+				c, NULL)) {
+		/* the Bus lets go of it when collected */
+		lua_pushnil(L);
+		lua_pushliteral(L, "Error setting watch functions");
+		return 2;
+	}
+
+	/* ..and timeout functions */
+	if (!dbus_connection_set_timeout_functions(conn,
+				(DBusAddTimeoutFunction)add_timeout_cb,
+				(DBusRemoveTimeoutFunction)remove_timeout_cb,
+				(DBusTimeoutToggledFunction)toggle_timeout_cb,
+				c->ctx, NULL)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Error setting timeout functions");
+		return 2;
+	}
+
+	/* track our names and set the signal handler */
+	if (!dbus_connection_add_filter(conn,
+				(DBusHandleMessageFunction)name_filter,
+				c, NULL) ||
+			!dbus_connection_add_filter(conn,
+				(DBusHandleMessageFunction)signal_handler,
+				S, NULL)) {
+		dbus_connection_unref(conn);
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	/* insert the connection in the connection table */
+	lua_pushlightuserdata(L, conn);
+	lua_pushvalue(L, 1);
+	lua_rawset(L, lua_upvalueindex(2));
+
+	/* return the connection */
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * get the shared connection to a message bus, or a private
+ * one if another Lua state already uses the shared one
+ */
+static int bus_get(lua_State *L, DBusBusType type)
+{
+	DBusError err;
+	int r;
+
+	dbus_error_init(&err);
+	r = new_connection(L, dbus_bus_get(type, &err), &err, 0);
+	if (r)
+		return r;
+
+	return new_connection(L, dbus_bus_get_private(type, &err), &err, 1);
+}
+
+/*
+ * SessionBus()
+ */
+static int simpledbus_session_bus(lua_State *L)
+{
+	return bus_get(L, DBUS_BUS_SESSION);
+}
+
+/*
+ * SystemBus()
+ */
+static int simpledbus_system_bus(lua_State *L)
+{
+	return bus_get(L, DBUS_BUS_SYSTEM);
+}
+
+/*
+ * StarterBus()
+ */
+static int simpledbus_starter_bus(lua_State *L)
+{
+	return bus_get(L, DBUS_BUS_STARTER);
+}
+
+/*
+ * open()
+ */
+static int simpledbus_open(lua_State *L)
+{
+	const char *address = luaL_checkstring(L, 1);
+	DBusError err;
+	int r;
+
+	dbus_error_init(&err);
+	r = new_connection(L, dbus_connection_open(address, &err), &err, 0);
+	if (r)
+		return r;
+
+	return new_connection(L, dbus_connection_open_private(address, &err),
+			&err, 1);
+}
+
+/*
+ * servers listen for connections from other processes
+ * directly, without a message bus in between
+ */
+typedef struct {
+	DBusServer *server;
+	LContext *ctx;
+	/* the main loop thread while it handles our watches */
+	lua_State *L;
+	/* registry reference to ourselves until we're closed */
+	int ref;
+} LServer;
+
+struct server_watch {
+	LSource source;
+	DBusWatch *watch;
+	LServer *s;
+	int added;
+};
+
+static void server_watch_handle(LSource *source, lua_State *L)
+{
+	struct server_watch *w = (struct server_watch *)source;
+
+	w->s->L = L;
+	/* this may remove the watch, so don't touch w after it */
+	(void)dbus_watch_handle(w->watch, DBUS_WATCH_READABLE);
+}
+
+static void server_watch_toggle(DBusWatch *watch, LServer *s)
+{
+	struct server_watch *w = dbus_watch_get_data(watch);
+
+	if (dbus_watch_get_enabled(watch)) {
+		if (!w->added)
+			source_add(s->ctx, &w->source);
+		w->added = 1;
+	} else {
+		if (w->added)
+			source_remove(s->ctx, &w->source);
+		w->added = 0;
+	}
+}
+
+static dbus_bool_t server_watch_add(DBusWatch *watch, LServer *s)
+{
+	struct server_watch *w = malloc(sizeof(struct server_watch));
+
+	if (w == NULL)
+		return FALSE;
+
+	w->source.fd = dbus_watch_get_unix_fd(watch);
+	w->source.handle = server_watch_handle;
+	w->watch = watch;
+	w->s = s;
+	w->added = 0;
+	dbus_watch_set_data(watch, w, NULL);
+
+	server_watch_toggle(watch, s);
+	return TRUE;
+}
+
+static void server_watch_remove(DBusWatch *watch, LServer *s)
+{
+	struct server_watch *w = dbus_watch_get_data(watch);
+
+	if (w == NULL)
+		return;
+
+	if (w->added)
+		source_remove(s->ctx, &w->source);
+	dbus_watch_set_data(watch, NULL, NULL);
+	free(w);
+}
+
+/*
+ * make a Bus for a private connection we hold a reference to.
+ * servers call this protected, so running out of memory
+ * doesn't kill the main loop
+ *
+ * upvalue 1: Bus
+ * upvalue 2: connection table
+ *
+ * argument 1: the DBusConnection
+ */
+static int accept_connection(lua_State *L)
+{
+	DBusConnection *conn = lua_touserdata(L, 1);
+	DBusError err;
+	int r;
 
-	if (stop < 0)
-		return lua_error(L);
+	dbus_error_init(&err);
+	r = new_connection(L, conn, &err, 1);
+	if (r == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
 
-	return stop;
+	return r;
 }
 
 /*
- * stop()
+ * attach the new connection to the main loop and run the
+ * on_connection function with it in a new thread
  */
-static int simpledbus_stop(lua_State *L)
+static void server_new_connection(DBusServer *server,
+		DBusConnection *conn, LServer *s)
 {
-	if (mainThread == NULL)
-		return luaL_error(L, "Main loop not running");
+	lua_State *L = s->L;
+	lua_State *T;
+	int r;
 
-	stop = lua_gettop(L);
+	(void)server;
 
-	if (stop == 0) {
-		lua_pushboolean(L, 1);
-		stop = 1;
+	/* the Bus takes over this reference */
+	dbus_connection_ref(conn);
+
+	/* get the table of the server */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, s->ref);
+	lua_getuservalue(L, -1);
+	lua_replace(L, -2);
+
+	lua_rawgeti(L, -1, 2);
+	lua_pushlightuserdata(L, conn);
+	r = lua_pcall(L, 1, 1, 0);
+	if (r || lua_type(L, -1) != LUA_TUSERDATA) {
+		/* the connection is dropped. if accepting it
+		 * failed before a Bus took over our reference,
+		 * it's still ours to let go of */
+		if (r && dbus_connection_get_data(conn, lcon_slot) == NULL) {
+			dbus_connection_close(conn);
+			dbus_connection_unref(conn);
+		}
+		lua_pop(L, 2);
+		return;
 	}
 
-	lua_checkstack(mainThread, stop);
+	attach_connection(L, s->ctx, -1);
 
-	lua_xmove(L, mainThread, stop);
+	T = lua_newthread(L);
+	lua_pushnil(T);
+	lua_rawgeti(L, -3, 1);
+	lua_pushvalue(L, -3);
+	lua_xmove(L, T, 2);
+
+	resume_thread(s->ctx, T, 1);
+	/* leave what stop() or an error put
+	 * on top of the stack for the main loop */
+	if (s->ctx->stop)
+		return;
 
-	return 0;
+	lua_pop(L, 3);
 }
 
-static int new_connection(lua_State *L, DBusConnection *conn)
+static LServer *server_check(lua_State *L, int index)
 {
-	LCon *c;
-	lua_State *S;
+	LServer *s;
+	int r;
 
-	if (dbus_error_is_set(&err)) {
-		lua_pushnil(L);
-		lua_pushstring(L, err.message);
-		dbus_error_free(&err);
-		return 2;
-	}
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index, "expected a Server");
 
-	if (conn == NULL) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Couldn't create connection");
-		return 2;
-	}
+	r = lua_compare(L, lua_upvalueindex(1), -1, LUA_OPEQ);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index, "expected a Server");
 
-	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+	s = lua_touserdata(L, index);
+	if (s->server == NULL)
+		luaL_argerror(L, index, "server is closed");
 
-	lua_pushlightuserdata(L, conn);
-	lua_rawget(L, lua_upvalueindex(2)); /* connection table */
-	if (lua_type(L, -1) == LUA_TUSERDATA) {
-		dbus_connection_unref(conn);
-		return 1;
-	}
+	return s;
+}
 
-	lua_settop(L, 0);
+static void server_close(lua_State *L, LServer *s)
+{
+	/* this removes all the watches */
+	dbus_server_disconnect(s->server);
+	(void)dbus_server_set_watch_functions(s->server,
+			NULL, NULL, NULL, NULL, NULL);
+	(void)dbus_server_set_timeout_functions(s->server,
+			NULL, NULL, NULL, NULL, NULL);
+	dbus_server_unref(s->server);
+	s->server = NULL;
+
+	luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+	s->ref = LUA_NOREF;
+}
 
-	/* create new userdata for the bus */
-	c = lua_newuserdata(L, sizeof(LCon));
-	if (c == NULL) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
-		return 2;
-	}
-	c->conn = conn;
-	c->nactive = 0;
-	c->active = NULL;
+/*
+ * listen()
+ *
+ * upvalue 1: Server
+ * upvalue 2: Bus
+ * upvalue 3: connection table
+ *
+ * argument 1: address
+ * argument 2: function
+ *
+ * Listen for connections on the address and run the function
+ * with a Bus for every new connection. The Bus is run by the
+ * main loop until the other end closes it, but the server
+ * must be closed explicitly.
+ */
+static int simpledbus_listen(lua_State *L)
+{
+	const char *address = luaL_checkstring(L, 1);
+	LServer *s;
+	DBusError err;
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+
+	s = lua_newuserdata(L, sizeof(LServer));
+	s->server = NULL;
+	s->ctx = get_context(L);
+	s->L = NULL;
+	s->ref = LUA_NOREF;
 
-	/* set the metatable */
 	lua_pushvalue(L, lua_upvalueindex(1));
-	lua_setmetatable(L, 1);
+	lua_setmetatable(L, 3);
 
-	/* create new environment table for
-	 * signal handlers and running threads */
+	/* save the function and the accept function */
 	lua_createtable(L, 2, 0);
 	lua_pushvalue(L, 2);
-	lua_setuservalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_pushvalue(L, lua_upvalueindex(3));
+	lua_pushcclosure(L, accept_connection, 2);
+	lua_rawseti(L, -2, 2);
+	lua_setuservalue(L, 3);
 
-	/* create thread for signal handler */
-	S = lua_newthread(L);
-	if (S == NULL) {
+	dbus_error_init(&err);
+	s->server = dbus_server_listen(address, &err);
+	if (s->server == NULL) {
 		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
+		lua_pushstring(L, err.message);
+		dbus_error_free(&err);
 		return 2;
 	}
-	/* ..and save it */
-	lua_rawseti(L, 2, 1);
 
-	/* create signal table */
-	lua_newtable(L);
-	/* ..save it */
 	lua_pushvalue(L, 3);
-	lua_rawseti(L, 2, 2);
-	/* ..and move it to the thread */
-	lua_xmove(L, S, 1);
-
-	/* set watch functions */
-	if (!dbus_connection_set_watch_functions(conn,
-				(DBusAddWatchFunction)add_watch_cb,
-				(DBusRemoveWatchFunction)remove_watch_cb,
-				(DBusWatchToggledFunction)toggle_watch_cb,
-				c, NULL)) {
-		dbus_connection_unref(conn);
-		lua_pushnil(L);
-		lua_pushliteral(L, "Error setting watch functions");
-		return 2;
-	}
-
-	/* set the signal handler */
-	if (!dbus_connection_add_filter(conn,
-				(DBusHandleMessageFunction)signal_handler,
-				S, NULL)) {
-		dbus_connection_unref(conn);
+	s->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	dbus_server_set_new_connection_function(s->server,
+			(DBusNewConnectionFunction)server_new_connection,
+			s, NULL);
+
+	if (!dbus_server_set_watch_functions(s->server,
+				(DBusAddWatchFunction)server_watch_add,
+				(DBusRemoveWatchFunction)server_watch_remove,
+				(DBusWatchToggledFunction)server_watch_toggle,
+				s, NULL) ||
+			!dbus_server_set_timeout_functions(s->server,
+				(DBusAddTimeoutFunction)add_timeout_cb,
+				(DBusRemoveTimeoutFunction)remove_timeout_cb,
+				(DBusTimeoutToggledFunction)toggle_timeout_cb,
+				s->ctx, NULL)) {
+		server_close(L, s);
 		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
 
-	/* insert the connection in the connection table */
-	lua_pushlightuserdata(L, conn);
-	lua_pushvalue(L, 1);
-	lua_rawset(L, lua_upvalueindex(2));
-
-	/* return the connection */
-	lua_settop(L, 1);
 	return 1;
 }
 
 /*
- * SessionBus()
+ * Server:address()
+ *
+ * upvalue 1: Server
+ *
+ * argument 1: server
+ *
+ * Returns the address other processes can connect to.
  */
-static int simpledbus_session_bus(lua_State *L)
+static int server_address(lua_State *L)
 {
-	return new_connection(L, dbus_bus_get(DBUS_BUS_SESSION, &err));
+	LServer *s = server_check(L, 1);
+	char *address = dbus_server_get_address(s->server);
+
+	if (address == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	lua_pushstring(L, address);
+	dbus_free(address);
+	return 1;
 }
 
 /*
- * SystemBus()
+ * Server:close()
+ *
+ * upvalue 1: Server
+ *
+ * argument 1: server
+ *
+ * Stop listening. Connections already accepted stay open.
  */
-static int simpledbus_system_bus(lua_State *L)
+static int server_close_method(lua_State *L)
 {
-	return new_connection(L, dbus_bus_get(DBUS_BUS_SYSTEM, &err));
+	server_close(L, server_check(L, 1));
+
+	lua_pushboolean(L, 1);
+	return 1;
 }
 
 /*
- * StarterBus()
+ * Server.__gc()
  */
-static int simpledbus_starter_bus(lua_State *L)
+static int server_gc(lua_State *L)
 {
-	return new_connection(L, dbus_bus_get(DBUS_BUS_STARTER, &err));
+	LServer *s = lua_touserdata(L, 1);
+
+	if (s->server)
+		server_close(L, s);
+
+	return 0;
 }
 
 /*
- * open()
+ * pool()
+ *
+ * upvalue 1: BusPool
+ * upvalue 2: Bus
+ * upvalue 3: connection table
+ *
+ * argument 1: "session", "system" or "starter"
+ * argument 2: number of connections
+ *
+ * Returns a BusPool, which is an array of private connections
+ * to the message bus. They are attached to the main loop like
+ * connections accepted by a server, so they don't have to be
+ * given to mainloop().
  */
-static int simpledbus_open(lua_State *L)
+static int simpledbus_pool(lua_State *L)
 {
-	return new_connection(L,
-			dbus_connection_open(luaL_checkstring(L, 1), &err));
+	static const char *const names[] = {
+		"session", "system", "starter", NULL
+	};
+	static const DBusBusType types[] = {
+		DBUS_BUS_SESSION, DBUS_BUS_SYSTEM, DBUS_BUS_STARTER
+	};
+	DBusBusType type = types[luaL_checkoption(L, 1, NULL, names)];
+	long n = luaL_checklong(L, 2);
+	LContext *ctx = get_context(L);
+	long i;
+
+	if (n < 1)
+		return luaL_argerror(L, 2, "expected at least 1 connection");
+
+	lua_settop(L, 2);
+	lua_createtable(L, n, 0);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, 3);
+
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_pushvalue(L, lua_upvalueindex(3));
+	lua_pushcclosure(L, accept_connection, 2);
+
+	for (i = 1; i <= n; i++) {
+		DBusConnection *conn;
+		DBusError err;
+
+		dbus_error_init(&err);
+		conn = dbus_bus_get_private(type, &err);
+		if (conn == NULL) {
+			lua_pushnil(L);
+			if (dbus_error_is_set(&err)) {
+				lua_pushstring(L, err.message);
+				dbus_error_free(&err);
+			} else
+				lua_pushliteral(L, "Couldn't create connection");
+			return 2;
+		}
+
+		lua_pushvalue(L, 4);
+		lua_pushlightuserdata(L, conn);
+		lua_call(L, 1, 2);
+		if (lua_isnil(L, -2))
+			return 2;
+		lua_pop(L, 1);
+		lua_rawseti(L, 3, i);
+	}
+
+	/* attach them only when all of them are there,
+	 * so the others are closed if one fails */
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 3, i);
+		attach_connection(L, ctx, 5);
+		lua_pop(L, 1);
+	}
+
+	lua_settop(L, 3);
+	return 1;
 }
 
 #define set_dbus_string_constant(L, name) \
@@ -1202,19 +5462,51 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 		{"call_method", bus_call_method},
 		{"send_signal", bus_send_signal},
 		{"register_object_path", bus_register_object_path},
+		{"register_fallback", bus_register_fallback},
 		{"unregister_object_path", bus_unregister_object_path},
+		{"cork", bus_cork},
+		{"uncork", bus_uncork},
+		{"flush", bus_flush},
+		{"start_io_thread", bus_start_io_thread},
+		{"stop_io_thread", bus_stop_io_thread},
+		{"pending", bus_pending},
+		{"stats", bus_stats},
+		{"latency_report", bus_latency_report},
+		{"close", bus_close},
 		{NULL, NULL}
 	};
 	luaL_Reg *p;
 
-	/* initialise the errors */
-	dbus_error_init(&err);
-
-	/* initialise the vtable */
-	vtable.unregister_function = NULL;
-	vtable.message_function =
-		(DBusObjectPathMessageFunction)method_call_handler;
-
+	/* Lua states on other threads may use libdbus too */
+	if (!dbus_threads_init_default())
+		return luaL_error(L, "Out of memory");
+
+	/* get a slot for finding our connection data */
+	if (!dbus_connection_allocate_data_slot(&lcon_slot) ||
+			!dbus_pending_call_allocate_data_slot(&pending_slot) ||
+			!dbus_message_allocate_data_slot(&loopback_slot) ||
+			!dbus_message_allocate_data_slot(&started_slot))
+		return luaL_error(L, "Out of memory");
+
+	/* make the main loop context of this Lua state,
+	 * unless the module was loaded here before */
+	lua_pushlightuserdata(L, (void *)&context_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_isnil(L, -1)) {
+		LContext *ctx;
+
+		lua_pushlightuserdata(L, (void *)&context_key);
+		ctx = lua_newuserdata(L, sizeof(LContext));
+		ctx->main = NULL;
+		ctx->stop = 0;
+		ctx->sources = NULL;
+		ctx->sources_changed = 0;
+		ctx->attached = NULL;
+		ctx->attached_changed = 0;
+		ctx->timers = NULL;
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	lua_pop(L, 1);
 
 	/* make a table for this module */
 	lua_newtable(L);
@@ -1223,6 +5515,109 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 	lua_pushcclosure(L, simpledbus_stop, 0);
 	lua_setfield(L, -2, "stop");
 
+	/* insert the running() function */
+	lua_pushcclosure(L, simpledbus_running, 0);
+	lua_setfield(L, -2, "running");
+
+	/* insert the wait() and wake() functions */
+	lua_newtable(L);
+	lua_pushvalue(L, -1); /* upvalue 1: waiting threads */
+	lua_pushcclosure(L, simpledbus_wait, 1);
+	lua_setfield(L, -3, "wait");
+	lua_pushcclosure(L, simpledbus_wake, 1);
+	lua_setfield(L, -2, "wake");
+
+	/* insert the clock() function */
+	lua_pushcclosure(L, simpledbus_clock, 0);
+	lua_setfield(L, -2, "clock");
+
+	/* insert the memfd() and close() functions */
+	lua_pushcclosure(L, simpledbus_memfd, 0);
+	lua_setfield(L, -2, "memfd");
+	lua_pushcclosure(L, simpledbus_close, 0);
+	lua_setfield(L, -2, "close");
+
+	/* make the Mapping metatable */
+	lua_newtable(L);
+
+	/* Mapping.__index = Mapping */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushvalue(L, -1); /* upvalue 1: Mapping */
+	lua_pushcclosure(L, mapping_sub, 1);
+	lua_setfield(L, -2, "sub");
+
+	lua_pushvalue(L, -1); /* upvalue 1: Mapping */
+	lua_pushcclosure(L, mapping_len, 1);
+	lua_setfield(L, -2, "__len");
+
+	lua_pushvalue(L, -1); /* upvalue 1: Mapping */
+	lua_pushcclosure(L, mapping_unmap, 1);
+	lua_setfield(L, -2, "unmap");
+
+	lua_pushcclosure(L, mapping_gc, 0);
+	lua_setfield(L, -2, "__gc");
+
+	/* insert the mmap() function */
+	lua_pushvalue(L, -1); /* upvalue 1: Mapping */
+	lua_pushcclosure(L, simpledbus_mmap, 1);
+	lua_setfield(L, -3, "mmap");
+
+	/* insert the Mapping metatable */
+	lua_setfield(L, -2, "Mapping");
+
+	/* make the Pool metatable */
+	lua_newtable(L);
+	lua_pushcclosure(L, pool_gc, 0);
+	lua_setfield(L, -2, "__gc");
+
+	/* insert the worker_pool() function */
+	lua_pushvalue(L, -1); /* upvalue 1: Pool */
+	lua_pushcclosure(L, simpledbus_worker_pool, 1);
+	lua_setfield(L, -3, "worker_pool");
+
+	/* insert the Pool metatable */
+	lua_setfield(L, -2, "Pool");
+
+	/* make the Channel metatable */
+	lua_newtable(L);
+
+	/* Channel.__index = Channel */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushvalue(L, -1); /* upvalue 1: Channel */
+	lua_pushcclosure(L, channel_send, 1);
+	lua_setfield(L, -2, "send");
+
+	lua_pushvalue(L, -1); /* upvalue 1: Channel */
+	lua_pushcclosure(L, channel_receive, 1);
+	lua_setfield(L, -2, "receive");
+
+	lua_pushvalue(L, -1); /* upvalue 1: Channel */
+	lua_pushcclosure(L, channel_on_receive, 1);
+	lua_setfield(L, -2, "on_receive");
+
+	lua_pushcclosure(L, channel_gc, 0);
+	lua_setfield(L, -2, "__gc");
+
+	/* insert the channel() function */
+	lua_pushvalue(L, -1); /* upvalue 1: Channel */
+	lua_pushcclosure(L, simpledbus_channel, 1);
+	lua_setfield(L, -3, "channel");
+
+	/* insert the Channel metatable */
+	lua_setfield(L, -2, "Channel");
+
+	/* insert the method_xml() function */
+	lua_pushcclosure(L, simpledbus_method_xml, 0);
+	lua_setfield(L, -2, "method_xml");
+
+	/* insert the spawn() function */
+	lua_pushcclosure(L, simpledbus_spawn, 0);
+	lua_setfield(L, -2, "spawn");
+
 	/* make the Bus metatable */
 	lua_newtable(L);
 
@@ -1230,10 +5625,14 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
 
-	/* insert the mainloop() function*/
-	lua_pushvalue(L, -1); /* upvalue 1: Bus */
-	lua_pushcclosure(L, simpledbus_mainloop, 1);
-	lua_setfield(L, -3, "mainloop");
+	/* insert the mainloop() and defer() functions */
+	lua_newtable(L);
+	lua_pushvalue(L, -2); /* upvalue 1: Bus */
+	lua_pushvalue(L, -2); /* upvalue 2: deferred functions */
+	lua_pushcclosure(L, simpledbus_mainloop, 2);
+	lua_setfield(L, -4, "mainloop");
+	lua_pushcclosure(L, simpledbus_defer, 1);
+	lua_setfield(L, -3, "defer");
 
 	/* create table for connections and let
 	 * the values be weak references */
@@ -1267,6 +5666,51 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 	lua_pushcclosure(L, simpledbus_open, 2);
 	lua_setfield(L, -4, "open");
 
+	/* make the Server metatable */
+	lua_newtable(L);
+
+	/* Server.__index = Server */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushvalue(L, -1); /* upvalue 1: Server */
+	lua_pushcclosure(L, server_address, 1);
+	lua_setfield(L, -2, "address");
+
+	lua_pushvalue(L, -1); /* upvalue 1: Server */
+	lua_pushcclosure(L, server_close_method, 1);
+	lua_setfield(L, -2, "close");
+
+	lua_pushcclosure(L, server_gc, 0);
+	lua_setfield(L, -2, "__gc");
+
+	/* insert the listen() function */
+	lua_pushvalue(L, -1); /* upvalue 1: Server */
+	lua_pushvalue(L, -4); /* upvalue 2: Bus */
+	lua_pushvalue(L, -4); /* upvalue 3: connection table */
+	lua_pushcclosure(L, simpledbus_listen, 3);
+	lua_setfield(L, -5, "listen");
+
+	/* insert the Server metatable */
+	lua_setfield(L, -4, "Server");
+
+	/* make the BusPool metatable */
+	lua_newtable(L);
+
+	/* BusPool.__index = BusPool */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	/* insert the pool() function */
+	lua_pushvalue(L, -1); /* upvalue 1: BusPool */
+	lua_pushvalue(L, -4); /* upvalue 2: Bus */
+	lua_pushvalue(L, -4); /* upvalue 3: connection table */
+	lua_pushcclosure(L, simpledbus_pool, 3);
+	lua_setfield(L, -5, "pool");
+
+	/* insert the BusPool metatable */
+	lua_setfield(L, -4, "BusPool");
+
 	/* pop connection table */
 	lua_pop(L, 1);
 
@@ -1281,6 +5725,75 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 	lua_pushcclosure(L, bus_gc, 0);
 	lua_setfield(L, -2, "__gc");
 
+	/* make the Emitter metatable */
+	lua_newtable(L);
+
+	/* Emitter.__index = Emitter */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	/* insert Emitter methods */
+	lua_pushvalue(L, -1); /* upvalue 1: Emitter */
+	lua_pushcclosure(L, emitter_emit, 1);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, "emit");
+	lua_setfield(L, -2, "__call");
+
+	lua_pushcclosure(L, emitter_gc, 0);
+	lua_setfield(L, -2, "__gc");
+
+	/* insert the prepare_signal() method */
+	lua_pushvalue(L, -2); /* upvalue 1: Bus */
+	lua_pushvalue(L, -2); /* upvalue 2: Emitter */
+	lua_pushcclosure(L, bus_prepare_signal, 2);
+	lua_setfield(L, -3, "prepare_signal");
+
+	/* insert the Emitter metatable */
+	lua_setfield(L, -3, "Emitter");
+
+	/* make the BoundMethod metatable */
+	lua_newtable(L);
+
+	/* BoundMethod.__index = BoundMethod */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushvalue(L, -1); /* upvalue 1: BoundMethod */
+	lua_pushcclosure(L, bound_method_call, 1);
+	lua_setfield(L, -2, "__call");
+
+	lua_pushcclosure(L, bound_method_gc, 0);
+	lua_setfield(L, -2, "__gc");
+
+	/* insert the bind_method() method */
+	lua_pushvalue(L, -2); /* upvalue 1: Bus */
+	lua_pushvalue(L, -2); /* upvalue 2: BoundMethod */
+	lua_pushcclosure(L, bus_bind_method, 2);
+	lua_setfield(L, -3, "bind_method");
+
+	/* insert the BoundMethod metatable */
+	lua_setfield(L, -3, "BoundMethod");
+
+	/* make the Reply metatable */
+	lua_newtable(L);
+
+	lua_pushcclosure(L, reply_gc, 0);
+	lua_setfield(L, -2, "__gc");
+
+	/* insert the prepare_reply() function */
+	lua_pushvalue(L, -1); /* upvalue 1: Reply */
+	lua_pushcclosure(L, simpledbus_prepare_reply, 1);
+	lua_setfield(L, -4, "prepare_reply");
+
+	/* insert the introspect() method */
+	lua_pushvalue(L, -2); /* upvalue 1: Bus */
+	lua_pushvalue(L, -2); /* upvalue 2: Reply */
+	lua_pushcclosure(L, bus_introspect, 2);
+	lua_setfield(L, -3, "introspect");
+
+	/* insert the Reply metatable */
+	lua_setfield(L, -3, "Reply");
+
 	/* insert the Bus metatable */
 	lua_setfield(L, -2, "Bus");
 
@@ -1311,6 +5824,12 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 	lua_pushcclosure(L, proxy_parse, 2);
 	lua_setfield(L, -4, "parse");
 
+	/* ..and the expat based one */
+	lua_pushvalue(L, -2); /* upvalue 1: Method */
+	lua_pushvalue(L, -2); /* upvalue 2: Signal */
+	lua_pushcclosure(L, proxy_parse_expat, 2);
+	lua_setfield(L, -4, "parse_expat");
+
 	/* insert the Signal metatable */
 	lua_setfield(L, -4, "Signal");
 
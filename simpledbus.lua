@@ -65,6 +65,17 @@ do
          method.signature, ...)
    end
 
+   -- bind the method to the object of an interface once
+   -- and get back a callable which only marshals the arguments.
+   -- replies not matching the introspected result are errors
+   function M.Method:bind(interface)
+      local proxy = getmetatable(interface)
+      return proxy.bus:bind_method(
+         proxy.target, proxy.object,
+         interface.name, self.name, false,
+         self.signature, self.result)
+   end
+
    local target, object, interface =
       M.SERVICE_DBUS, M.PATH_DBUS, M.INTERFACE_DBUS
 
@@ -90,54 +101,787 @@ do
 end
 
 do
-   local Proxy = M.Proxy
-   local function new_proxy(bus, target, object)
-      return setmetatable({
+   local BusPool = M.BusPool
+   local call_method, pending = M.Bus.call_method, M.Bus.pending
+   local huge = math.huge
+
+   -- Returns the connection with the fewest calls waiting for
+   -- a reply. The search starts after the connection picked
+   -- last time, so idle connections take turns.
+   function BusPool:get()
+      local n, last = #self, self.last or 0
+      local best, min = 1, huge
+
+      for i = 1, n do
+         local j = (last + i - 1) % n + 1
+         local p = pending(self[j])
+         if p < min then best, min = j, p end
+      end
+
+      self.last = best
+      return self[best]
+   end
+
+   function BusPool:call_method(...)
+      return call_method(self:get(), ...)
+   end
+
+   function BusPool:close()
+      for i = 1, #self do
+         self[i]:close()
+      end
+   end
+end
+
+do
+   local pairs, rawget, rawset = pairs, rawget, rawset
+   local getmetatable, setmetatable = getmetatable, setmetatable
+   local format = string.format
+   local Proxy, Signal = M.Proxy, M.Signal
+   local call_method = M.Bus.call_method
+   local INTERFACE_PROPERTIES = M.INTERFACE_PROPERTIES
+
+   -- Interfaces, methods and signals parsed from introspection data
+   -- are shared by all proxies for objects with the same XML. Each
+   -- proxy only gets small interface tables looking up their members
+   -- in the template. Signals know their object, so every proxy gets
+   -- its own copy of those.
+   local templates = setmetatable({}, { __mode = 'v' })
+
+   local function parse_template(xml)
+      local template = templates[xml]
+      if template then return template end
+
+      template = { object = '' }
+      local r, msg = Proxy.parse(template, xml)
+      if not r then return nil, msg end
+      template.object = nil
+
+      templates[xml] = template
+      return template
+   end
+   M.parse_template = parse_template
+
+   -- build a template from a description like the ones
+   -- written by simpledbus-gen, so proxies for well known
+   -- objects can be made without introspecting them first
+   --
+   --   { ['org.example.Iface'] = {
+   --        methods = { Name = { signature, result } },
+   --        signals = { Name = signature },
+   --        properties = { Name = { type = t, access = a } } } }
+   local Method = M.Method
+   function M.new_template(description)
+      local template = {}
+      for name, desc in pairs(description) do
+         local interface = setmetatable({
+            name = name,
+            properties = {}
+         }, template)
+
+         if desc.methods then
+            for member, m in pairs(desc.methods) do
+               interface[member] = setmetatable({
+                  name = member,
+                  interface = interface,
+                  signature = m[1] or '',
+                  result = m[2] or ''
+               }, Method)
+            end
+         end
+         if desc.signals then
+            for member, signature in pairs(desc.signals) do
+               interface[member] = setmetatable({
+                  name = member,
+                  interface = name,
+                  signature = signature
+               }, Signal)
+            end
+         end
+         if desc.properties then
+            for member, p in pairs(desc.properties) do
+               interface.properties[member] = {
+                  type = p.type,
+                  access = p.access
+               }
+            end
+         end
+
+         template[name] = interface
+      end
+      return template
+   end
+
+   local function apply_template(proxy, template)
+      for name, interface in pairs(template) do
+         proxy[name] = setmetatable({
+            name = name,
+            properties = interface.properties
+         }, proxy)
+      end
+
+      proxy.__index = function(tab, key)
+         local name = rawget(tab, 'name')
+         local interface = template[name]
+         local member = interface and interface[key]
+         if member ~= nil then
+            if getmetatable(member) == Signal then
+               member = setmetatable({
+                  name = member.name,
+                  interface = name,
+                  signature = member.signature,
+                  object = proxy.object
+               }, Signal)
+            end
+            rawset(tab, key, member)
+            return member
+         end
+
+         local pif = proxy[INTERFACE_PROPERTIES]
+         local caches = rawget(proxy, 'property_caches')
+         local cache = caches and caches[name]
+         if cache then
+            local value = cache.values[key]
+            if value ~= nil then
+               cache.hits = cache.hits + 1
+               return value
+            end
+            cache.misses = cache.misses + 1
+            if rawget(proxy, 'coalesce') then
+               local values = proxy:get_all_properties(name, true)
+               if values and values[key] ~= nil then
+                  for k, v in pairs(values) do
+                     cache.values[k] = v
+                  end
+                  return values[key]
+               end
+            end
+            value = pif:Get(name, key)
+            if value ~= nil then
+               cache.values[key] = value
+            end
+            return value
+         end
+         if rawget(proxy, 'coalesce') then
+            local values = proxy:get_all_properties(name, true)
+            if values and values[key] ~= nil then
+               return values[key]
+            end
+         end
+         return pif:Get(name, key)
+      end
+      proxy.__newindex = function(tab, key, value)
+         local pif = proxy[INTERFACE_PROPERTIES]
+         local name = rawget(tab, 'name')
+         local properties = rawget(tab, 'properties')
+         local property = rawget(properties, key)
+         local r = pif:Set(name, key, {
+            signature = property.type,
+            value = value
+         })
+         local caches = rawget(proxy, 'property_caches')
+         if r and caches and caches[name] then
+            caches[name].values[key] = value
+         end
+      end
+
+      return proxy
+   end
+
+   local function new_proxy(bus, target, object, template)
+      local proxy = setmetatable({
          target = target,
          object = object,
          bus = bus
       }, Proxy)
+
+      if template then
+         return apply_template(proxy, template)
+      end
+
+      return proxy
    end
    M.Bus.new_proxy = new_proxy
 
+   -- Templates by connection, target and object. Only used
+   -- on connections asking for it with cache_introspection(), as
+   -- we then have to trust objects not to change their interfaces
+   -- for as long as their owner stays on the bus.
+   local objects = setmetatable({}, { __mode = 'k' })
+
+   local function owner_rule(target)
+      return format("type='signal',sender='%s',path='%s',interface='%s',"..
+         "member='NameOwnerChanged',arg0='%s'",
+         M.SERVICE_DBUS, M.PATH_DBUS, M.INTERFACE_DBUS, target)
+   end
+
+   function M.Bus:cache_introspection(enable)
+      local targets = objects[self]
+      if enable == false then
+         if targets then
+            objects[self] = nil
+            self:remove_signal_hook(M.PATH_DBUS, M.INTERFACE_DBUS,
+               'NameOwnerChanged', objects)
+            for target in pairs(targets) do
+               self:unref_match(owner_rule(target))
+            end
+         end
+         return true
+      end
+      if targets then return true end
+
+      -- forget everything about a target when its owner changes
+      targets = {}
+      self:add_signal_hook(M.PATH_DBUS, M.INTERFACE_DBUS, 'NameOwnerChanged',
+         objects, function(name)
+            if targets[name] then
+               targets[name] = {}
+            end
+         end)
+
+      objects[self] = targets
+      return true
+   end
+
+   local function remember(bus, targets, target, object, template)
+      local cached = targets[target]
+      if not cached then
+         -- ask to hear about owner changes of this target
+         local r, msg = bus:ref_match(owner_rule(target))
+         if not r then return nil, msg end
+         cached = {}
+         targets[target] = cached
+      end
+      cached[object] = template
+      return true
+   end
+
    function M.Bus:auto_proxy(target, object)
-      local proxy = new_proxy(self, target, object)
-      local introspectable = M.new_interface(M.INTERFACE_INTROSPECTABLE, proxy)
-      local introspect = M.new_method('Introspect', introspectable)
+      local targets = objects[self]
+      local cached = targets and targets[target]
+      local template = cached and cached[object]
+
+      if not template then
+         local xml, msg = call_method(self, target, object,
+            M.INTERFACE_INTROSPECTABLE, 'Introspect', false)
+         if not xml then
+            return nil, msg
+         end
+
+         template, msg = parse_template(xml)
+         if not template then
+            return nil, msg
+         end
+
+         if targets then
+            remember(self, targets, target, object, template)
+         end
+      end
+
+      return new_proxy(self, target, object, template)
+   end
+end
+
+do
+   local setmetatable, select, unpack = setmetatable, select, unpack
+   local pairs, running = pairs, coroutine.running
+   local spawn, wait, wake = M.spawn, M.wait, M.wake
+
+   -- a future holds the results of a function running in
+   -- its own thread. get() returns them, waiting for the
+   -- function to finish if it hasn't already
+   local Future = {}
+   Future.__index = Future
+   M.Future = Future
+
+   local function resolve(future, ...)
+      future.n = select('#', ...)
+      future.values = { ... }
+
+      local waiting = future.waiting
+      future.waiting = nil
+      for i = 1, #waiting do
+         wake(waiting[i])
+      end
+   end
+
+   function M.async(f, ...)
+      local future = setmetatable({ waiting = {} }, Future)
+      spawn(function(...)
+         return resolve(future, f(...))
+      end, ...)
+      return future
+   end
+
+   function Future:ready()
+      return self.values ~= nil
+   end
+
+   function Future:get()
+      if not self.values then
+         local waiting = self.waiting
+         waiting[#waiting + 1] = running()
+         wait()
+      end
+      return unpack(self.values, 1, self.n)
+   end
+
+   local async = M.async
+
+   -- while the main loop is running the Introspect calls
+   -- of several of these are all on the bus at the same time
+   function M.Bus:auto_proxy_async(target, object)
+      return async(self.auto_proxy, self, target, object)
+   end
+
+   -- objects is a table of { target, object } pairs. Returns
+   -- a table of proxies with the same keys, and a table of error
+   -- messages for the objects that failed, if any did
+   function M.Bus:auto_proxies(objects)
+      local futures = {}
+      for k, o in pairs(objects) do
+         futures[k] = async(self.auto_proxy, self, o[1], o[2])
+      end
+
+      local proxies, errors = {}, nil
+      for k, future in pairs(futures) do
+         local proxy, msg = future:get()
+         if proxy then
+            proxies[k] = proxy
+         else
+            errors = errors or {}
+            errors[k] = msg
+         end
+      end
+      return proxies, errors
+   end
+end
+
+do
+   local pairs, next, rawget = pairs, next, rawget
+   local setmetatable = setmetatable
+   local format = string.format
+   local INTERFACE_PROPERTIES = M.INTERFACE_PROPERTIES
+
+   -- Proxies with cached properties, per connection keyed by
+   -- object. A single hook on PropertiesChanged serves them all,
+   -- next to any handler registered for the signal.
+   local watched = setmetatable({}, { __mode = 'k' })
+
+   local function properties_changed(objects)
+      return function(sender, path, interface, changed, invalidated)
+         local proxies = objects[path]
+         if not proxies then return end
+         for _, entry in pairs(proxies) do
+            local cache = entry.owner == sender and entry.caches[interface]
+            if cache then
+               local values = cache.values
+               for k, v in pairs(changed) do
+                  values[k] = v
+               end
+               for i = 1, #invalidated do
+                  values[invalidated[i]] = nil
+               end
+            end
+         end
+      end
+   end
+
+   local function properties_rule(proxy)
+      return format("type='signal',sender='%s',path='%s',interface='%s',"..
+         "member='PropertiesChanged'",
+         proxy.target, proxy.object, INTERFACE_PROPERTIES)
+   end
+
+   local function watch(proxy, caches)
+      local bus, object = proxy.bus, proxy.object
+      local entry = { caches = caches }
+
+      -- only trust the current owner of the target, and
+      -- forget what the previous one told us when it changes
+      local owner, msg = bus:track_owner(proxy.target, entry, function(new)
+         entry.owner = new
+         for _, cache in pairs(caches) do
+            cache.values = {}
+         end
+      end)
+      if owner == nil then return nil, msg end
 
-      local r, msg = introspect(introspectable)
+      local r, msg = bus:ref_match(properties_rule(proxy))
       if not r then
+         bus:untrack_owner(proxy.target, entry)
          return nil, msg
       end
+      entry.owner = owner or nil
 
-      r, msg = proxy:parse(r)
-      if not r then
+      local objects = watched[bus]
+      if not objects then
+         objects = {}
+         watched[bus] = objects
+         bus:add_signal_hook('', INTERFACE_PROPERTIES, 'PropertiesChanged',
+            watched, properties_changed(objects))
+      end
+      local proxies = objects[object]
+      if not proxies then
+         proxies = {}
+         objects[object] = proxies
+      end
+      proxies[proxy] = entry
+      return true
+   end
+
+   local function unwatch(proxy)
+      local bus, object = proxy.bus, proxy.object
+      local objects = watched[bus]
+      local proxies = objects and objects[object]
+      local entry = proxies and proxies[proxy]
+      if not entry then return true end
+
+      proxies[proxy] = nil
+      if next(proxies) == nil then
+         objects[object] = nil
+         if next(objects) == nil then
+            watched[bus] = nil
+            bus:remove_signal_hook('', INTERFACE_PROPERTIES,
+               'PropertiesChanged', watched)
+         end
+      end
+      bus:untrack_owner(proxy.target, entry)
+      return bus:unref_match(properties_rule(proxy))
+   end
+
+   -- Serve property reads of an interface of an auto_proxy from a
+   -- local cache. The cache is seeded with one GetAll and kept fresh
+   -- by the PropertiesChanged signals the owner of the target sends
+   -- for the object. Properties which don't emit PropertiesChanged
+   -- will go stale.
+   function M.Proxy:cache_properties(name)
+      local caches = rawget(self, 'property_caches')
+      if not caches then
+         caches = {}
+         local r, msg = watch(self, caches)
+         if not r then return nil, msg end
+         self.property_caches = caches
+      end
+
+      local cache = caches[name]
+      if not cache then
+         cache = { values = {}, hits = 0, misses = 0 }
+         caches[name] = cache
+      end
+
+      local values, msg = self[INTERFACE_PROPERTIES]:GetAll(name)
+      if not values then
+         self:uncache_properties(name)
          return nil, msg
       end
+      -- the reply is newer than any change which arrived while
+      -- we waited, but keep values the reply didn't include
+      for k, v in pairs(values) do
+         cache.values[k] = v
+      end
 
-      proxy.__index = function(tab, key)
-         local pif = proxy[M.INTERFACE_PROPERTIES]
-         return pif:Get(tab.name, key)
+      return true
+   end
+
+   function M.Proxy:uncache_properties(name)
+      local caches = rawget(self, 'property_caches')
+      if not caches then return true end
+
+      caches[name] = nil
+      if next(caches) == nil then
+         self.property_caches = nil
+         return unwatch(self)
       end
-      proxy.__newindex = function(tab, key, value)
-         local pif = proxy[M.INTERFACE_PROPERTIES]
-         local properties = rawget(tab, 'properties')
-         local property = rawget(properties, key)
-         pif:Set(rawget(tab, 'name'), key, {
-            signature = property.type,
-            value = value
-         })
+
+      return true
+   end
+
+   -- Properties.GetAll calls per connection keyed by target, object
+   -- and interface. Replies are kept until the end of the dispatch
+   -- pass they arrive in, so later reads in that pass use them too
+   local calls = setmetatable({}, { __mode = 'k' })
+   local running, status = coroutine.running, coroutine.status
+   local main_running = M.running
+   local defer, spawn, wait, wake = M.defer, M.spawn, M.wait, M.wake
+
+   -- Get all properties of an interface. While the main loop runs,
+   -- threads asking for the same interface of the same object share
+   -- one GetAll, and reads in the rest of the pass the reply arrives
+   -- in get it without a round-trip. If nowait is true only such a
+   -- reply is returned, and nothing is sent.
+   function M.Proxy:get_all_properties(name, nowait)
+      local pif = self[INTERFACE_PROPERTIES]
+      if not main_running() then
+         if nowait then return nil end
+         return pif:GetAll(name)
       end
 
-      return proxy
+      local bus = self.bus
+      local pending = calls[bus]
+      if not pending then
+         pending = {}
+         calls[bus] = pending
+      end
+
+      local key = format('%s\n%s\n%s', self.target, self.object, name)
+      -- a thread which died with its call in flight
+      -- stopped the main loop, and won't wake anyone
+      local call = pending[key]
+      if call and call.waiting and status(call.thread) == 'dead' then
+         call = nil
+      end
+      if not call then
+         if nowait then return nil end
+
+         -- sent from a thread of its own, so the reply reaches
+         -- the waiting threads even if this one can't wait
+         call = { waiting = {} }
+         pending[key] = call
+         call.thread = spawn(function()
+            local values, msg = pif:GetAll(name)
+            local waiting = call.waiting
+            call.values, call.msg, call.waiting = values, msg, nil
+            defer(function()
+               if pending[key] == call then pending[key] = nil end
+            end)
+            for i = 1, #waiting do
+               wake(waiting[i], values, msg)
+            end
+         end)
+      end
+
+      local waiting = call.waiting
+      if not waiting then return call.values, call.msg end
+      if nowait then return nil end
+      waiting[#waiting+1] = running()
+      return wait()
+   end
+
+   function M.Proxy:get_property(name, key)
+      local values, msg = self:get_all_properties(name)
+      if not values then return nil, msg end
+      return values[key]
+   end
+
+   -- Let property reads through the interfaces of an auto_proxy use
+   -- the GetAll replies get_all_properties() keeps for the rest of a
+   -- dispatch pass. Lua 5.1 can't wait in __index, so reads there
+   -- without such a reply still send a Get, and threads wanting to
+   -- share one GetAll must use get_property().
+   function M.Proxy:coalesce_properties(enable)
+      self.coalesce = enable ~= false or nil
+   end
+
+   -- hits and misses of the property cache of an interface
+   function M.Proxy:property_cache_stats(name)
+      local caches = rawget(self, 'property_caches')
+      local cache = caches and caches[name]
+      if not cache then return nil, 'properties not cached' end
+      return cache.hits, cache.misses
    end
 end
 
 do
    local assert, getmetatable, type = assert, getmetatable, type
+   local pairs, next, setmetatable = pairs, next, setmetatable
    local format = string.format
    local Bus = M.Bus
-   local add_match = M.Bus.add_match
+   local call_method = M.Bus.call_method
+   local add_match, remove_match = M.Bus.add_match, M.Bus.remove_match
+   local SERVICE_DBUS, PATH_DBUS, INTERFACE_DBUS =
+      M.SERVICE_DBUS, M.PATH_DBUS, M.INTERFACE_DBUS
+
+   -- Signal handlers of this module, like the ones keeping caches
+   -- up to date, are hooks sharing the keys of the signal table
+   -- with handlers registered by the user. Such a key holds a
+   -- dispatcher calling every hook and then the user handler, so
+   -- neither replaces the other. Hooks add match rules of their own.
+   local dispatchers = setmetatable({}, { __mode = 'k' })
+
+   -- this magic string representation of an inconming
+   -- signal must match the one in the C code
+   local function signal_key(object, interface, name)
+      return format('%s\n%s\n%s', object, interface, name)
+   end
+
+   -- an empty object stands for the signal from any object,
+   -- and its handler gets the sender and object path first
+   local function signal_rule(object, interface, name)
+      if object == '' then
+         return format("type='signal',interface='%s',member='%s'",
+            interface, name)
+      end
+      return format("type='signal',path='%s',interface='%s',member='%s'",
+         object, interface, name)
+   end
+
+   local function get_handler(bus, s)
+      local ds = dispatchers[bus]
+      local d = ds and ds[s]
+      if d then return d.user end
+      return bus:get_signal_table()[s]
+   end
+
+   local function set_handler(bus, s, f)
+      local ds = dispatchers[bus]
+      local d = ds and ds[s]
+      if d then
+         d.user = f
+      else
+         bus:get_signal_table()[s] = f
+      end
+   end
+
+   function Bus:add_signal_hook(object, interface, name, id, f)
+      local ds = dispatchers[self]
+      if not ds then
+         ds = {}
+         dispatchers[self] = ds
+      end
+
+      local s = signal_key(object, interface, name)
+      local d = ds[s]
+      if not d then
+         local t = self:get_signal_table()
+         d = { user = t[s], hooks = {}, list = {} }
+         ds[s] = d
+         t[s] = function(...)
+            -- hooks may come and go while one of them is waiting,
+            -- so run the list as it was when the signal arrived
+            local list = d.list
+            for i = 1, #list do list[i](...) end
+            local f = d.user
+            if f then return f(...) end
+         end
+      end
+
+      d.hooks[id] = f
+      local list, n = {}, 0
+      for _, f in pairs(d.hooks) do
+         n = n + 1
+         list[n] = f
+      end
+      d.list = list
+   end
+
+   function Bus:remove_signal_hook(object, interface, name, id)
+      local ds = dispatchers[self]
+      local s = signal_key(object, interface, name)
+      local d = ds and ds[s]
+      if not d or d.hooks[id] == nil then return end
+
+      d.hooks[id] = nil
+      if next(d.hooks) == nil then
+         ds[s] = nil
+         self:get_signal_table()[s] = d.user
+         return
+      end
+
+      local list, n = {}, 0
+      for _, f in pairs(d.hooks) do
+         n = n + 1
+         list[n] = f
+      end
+      d.list = list
+   end
+
+   -- Match rules added by more than one hook on the
+   -- same connection are only removed with the last one.
+   local matches = setmetatable({}, { __mode = 'k' })
+
+   function Bus:ref_match(rule)
+      local ms = matches[self]
+      if not ms then
+         ms = {}
+         matches[self] = ms
+      end
+
+      local n = ms[rule]
+      if not n then
+         local r, msg = add_match(self, rule)
+         if msg then return nil, msg end
+         n = 0
+      end
+      ms[rule] = n + 1
+      return true
+   end
+
+   function Bus:unref_match(rule)
+      local ms = matches[self]
+      local n = ms and ms[rule]
+      if not n then return true end
+
+      if n > 1 then
+         ms[rule] = n - 1
+         return true
+      end
+      ms[rule] = nil
+      local r, msg = remove_match(self, rule)
+      if msg then return nil, msg end
+      return true
+   end
+
+   -- Hooks checking the sender of signals need to know the
+   -- unique name currently owning the name they talk to.
+   local owners = setmetatable({}, { __mode = 'k' })
+
+   local function owner_rule(name)
+      return format("type='signal',sender='%s',path='%s',interface='%s',"..
+         "member='NameOwnerChanged',arg0='%s'",
+         SERVICE_DBUS, PATH_DBUS, INTERFACE_DBUS, name)
+   end
+
+   -- Calls f(new_owner, old_owner) whenever the owner of name
+   -- changes, with new_owner nil when the name is released.
+   -- Returns the current owner, or false and a message if
+   -- there is none.
+   function Bus:track_owner(name, id, f)
+      local os = owners[self]
+      if not os then
+         os = {}
+         owners[self] = os
+      end
+
+      local o = os[name]
+      if not o then
+         local r, msg = self:ref_match(owner_rule(name))
+         if not r then return nil, msg end
+
+         o = { watchers = {} }
+         os[name] = o
+         self:add_signal_hook(PATH_DBUS, INTERFACE_DBUS, 'NameOwnerChanged',
+            o, function(n, old, new)
+               if n ~= name then return end
+               if new == '' then new = nil end
+               o.owner = new
+               for _, f in pairs(o.watchers) do f(new, old) end
+            end)
+      end
+      o.watchers[id] = f
+
+      if not o.owner then
+         -- the hook above keeps the owner up to date from now on
+         local owner, msg = call_method(self, SERVICE_DBUS, PATH_DBUS,
+            INTERFACE_DBUS, 'GetNameOwner', false, 's', name)
+         if not owner then return false, msg end
+         o.owner = owner
+      end
+      return o.owner
+   end
+
+   function Bus:untrack_owner(name, id)
+      local os = owners[self]
+      local o = os and os[name]
+      if not o then return end
+
+      o.watchers[id] = nil
+      if next(o.watchers) then return end
+
+      os[name] = nil
+      self:remove_signal_hook(PATH_DBUS, INTERFACE_DBUS, 'NameOwnerChanged', o)
+      self:unref_match(owner_rule(name))
+   end
 
    local function register_signal(bus, object, interface, name, f)
       assert(getmetatable(bus) == Bus,
@@ -151,20 +895,14 @@ do
       assert(type(f) == 'function',
          'bad argument #5 (function expected, got '..type(f))
 
-      local t = bus:get_signal_table()
+      local s = signal_key(object, interface, name)
 
-      -- this magic string representation of an inconming
-      -- signal must match the one in the C code
-      local s = format('%s\n%s\n%s', object, interface, name)
-
-      if t[s] == nil then
-         local r, msg = add_match(bus,
-               format("type='signal',path='%s',interface='%s',member='%s'",
-                     object, interface, name))
+      if get_handler(bus, s) == nil then
+         local r, msg = add_match(bus, signal_rule(object, interface, name))
          if msg then return nil, msg end
       end
 
-      t[s] = f
+      set_handler(bus, s, f)
 
       return true
    end
@@ -177,13 +915,6 @@ do
          signal.name,
          f)
    end
-end
-
-do
-   local assert, getmetatable, type = assert, getmetatable, type
-   local format = string.format
-   local Bus = M.Bus
-   local remove_match = M.Bus.remove_match
 
    local function unregister_signal(bus, object, interface, name)
       assert(getmetatable(bus) == Bus,
@@ -195,21 +926,15 @@ do
       assert(type(name) == 'string',
          'bad argument #4 (string expected, got '..type(name))
 
-      local t = bus:get_signal_table()
+      local s = signal_key(object, interface, name)
 
-      -- this magic string representation of an inconming
-      -- signal must match the one in the C code
-      local s = format('%s\n%s\n%s', object, interface, name)
+      assert(get_handler(bus, s) ~= nil, 'signal not set')
 
-      assert(t[s] ~= nil, 'signal not set')
-
-      local r, msg = remove_match(bus,
-            format("type='signal',path='%s',interface='%s',member='%s'",
-                  object, interface, name))
+      local r, msg = remove_match(bus, signal_rule(object, interface, name))
 
       if msg then return nil, msg end
 
-      t[s] = nil
+      set_handler(bus, s, nil)
 
       return true
    end
@@ -223,6 +948,259 @@ do
    end
 end
 
+do
+   local pairs, next, ipairs, setmetatable = pairs, next, ipairs, setmetatable
+   local format = string.format
+   local call_method, spawn = M.Bus.call_method, M.spawn
+   local INTERFACE_PROPERTIES = M.INTERFACE_PROPERTIES
+   local INTERFACE_OBJECT_MANAGER = 'org.freedesktop.DBus.ObjectManager'
+   M.INTERFACE_OBJECT_MANAGER = INTERFACE_OBJECT_MANAGER
+
+   -- A local mirror of all objects, interfaces and properties below
+   -- an org.freedesktop.DBus.ObjectManager. It is filled by one call
+   -- to GetManagedObjects and kept up to date by the signals of the
+   -- service, which all arrive through a single match rule. When the
+   -- name changes owner the mirror is emptied and filled again from
+   -- the new one.
+   --
+   --   om.objects[path][interface][property] = value
+   local ObjectManager = {}
+   ObjectManager.__index = ObjectManager
+   M.ObjectManager = ObjectManager
+
+   -- managers by connection and the unique bus name of their owner
+   local managers = setmetatable({}, { __mode = 'k' })
+
+   local function notify(om, event, ...)
+      local handlers = om.handlers[event]
+      if handlers then
+         for i = 1, #handlers do
+            handlers[i](...)
+         end
+      end
+   end
+
+   local function add_interfaces(om, path, interfaces)
+      local object = om.objects[path]
+      if not object then
+         object = {}
+         om.objects[path] = object
+      end
+      for name, properties in pairs(interfaces) do
+         object[name] = properties
+         notify(om, 'added', path, name, properties)
+      end
+   end
+
+   local function remove_interfaces(om, path, names)
+      local object = om.objects[path]
+      if not object then return end
+      for _, name in ipairs(names) do
+         if object[name] then
+            object[name] = nil
+            notify(om, 'removed', path, name)
+         end
+      end
+      if next(object) == nil then
+         om.objects[path] = nil
+      end
+   end
+
+   local function change_properties(om, path, name, changed, invalidated)
+      local object = om.objects[path]
+      local properties = object and object[name]
+      if not properties then return end
+      for k, v in pairs(changed) do
+         properties[k] = v
+      end
+      for i = 1, #invalidated do
+         properties[invalidated[i]] = nil
+      end
+      notify(om, 'changed', path, name, changed, invalidated)
+   end
+
+   -- hooks for these signals from any object, with
+   -- the sender and object path as first arguments
+   local handlers = {
+      { INTERFACE_OBJECT_MANAGER, 'InterfacesAdded',
+         function(om, path, object, interfaces)
+            if path == om.path then
+               add_interfaces(om, object, interfaces)
+            end
+         end },
+      { INTERFACE_OBJECT_MANAGER, 'InterfacesRemoved',
+         function(om, path, object, names)
+            if path == om.path then
+               remove_interfaces(om, object, names)
+            end
+         end },
+      { INTERFACE_PROPERTIES, 'PropertiesChanged', change_properties },
+   }
+
+   local function fill(om, owner)
+      local objects, msg = call_method(om.bus, om.target, om.path,
+         INTERFACE_OBJECT_MANAGER, 'GetManagedObjects', false)
+      if not objects then return nil, msg end
+      -- the owner changed again while we waited
+      if om.owner ~= owner then return true end
+      for object, interfaces in pairs(objects) do
+         add_interfaces(om, object, interfaces)
+      end
+      return true
+   end
+
+   local function set_owner(om, owner)
+      local owners = managers[om.bus]
+      local oms = om.owner and owners[om.owner]
+      if oms then
+         oms[om] = nil
+         if next(oms) == nil then
+            owners[om.owner] = nil
+         end
+      end
+
+      om.owner = owner
+      if owner then
+         oms = owners[owner]
+         if not oms then
+            oms = {}
+            owners[owner] = oms
+         end
+         oms[om] = true
+      end
+   end
+
+   -- the mirror describes the objects of the previous owner,
+   -- so report them all removed and ask the new one
+   local function owner_changed(om, owner)
+      set_owner(om, owner)
+
+      local objects = om.objects
+      om.objects = {}
+      for path, object in pairs(objects) do
+         for name in pairs(object) do
+            notify(om, 'removed', path, name)
+         end
+      end
+
+      if owner then
+         spawn(fill, om, owner)
+      end
+   end
+
+   local function watch(bus, om)
+      local owners = managers[bus]
+      if not owners then
+         owners = {}
+         managers[bus] = owners
+
+         for _, h in ipairs(handlers) do
+            local handler = h[3]
+            bus:add_signal_hook('', h[1], h[2], managers,
+               function(sender, path, ...)
+                  local oms = owners[sender]
+                  if oms then
+                     for om in pairs(oms) do
+                        handler(om, path, ...)
+                     end
+                  end
+               end)
+         end
+      end
+
+      local owner, msg = bus:track_owner(om.target, om, function(owner)
+         owner_changed(om, owner)
+      end)
+      if owner then
+         set_owner(om, owner)
+      end
+      return owner, msg
+   end
+
+   local function unwatch(bus, om)
+      local owners = managers[bus]
+      if not owners then return end
+
+      set_owner(om, nil)
+      bus:untrack_owner(om.target, om)
+      if next(owners) == nil then
+         managers[bus] = nil
+         for _, h in ipairs(handlers) do
+            bus:remove_signal_hook('', h[1], h[2], managers)
+         end
+      end
+   end
+
+   function M.Bus:object_manager(target, path)
+      path = path or '/'
+
+      local om = setmetatable({
+         bus = self,
+         target = target,
+         path = path,
+         objects = {},
+         handlers = {},
+         rule = format("type='signal',sender='%s',path_namespace='%s'",
+            target, path)
+      }, ObjectManager)
+
+      -- subscribe before asking so no change is lost
+      local r, msg = self:ref_match(om.rule)
+      if not r then return nil, msg end
+      r, msg = watch(self, om)
+      if not r then
+         om:close()
+         return nil, msg
+      end
+
+      r, msg = fill(om, om.owner)
+      if not r then
+         om:close()
+         return nil, msg
+      end
+
+      return om
+   end
+
+   -- event is 'added', 'removed' or 'changed', and f is called with
+   --   added:   path, interface, properties
+   --   removed: path, interface
+   --   changed: path, interface, changed properties, invalidated names
+   function ObjectManager:on(event, f)
+      local handlers = self.handlers[event]
+      if not handlers then
+         handlers = {}
+         self.handlers[event] = handlers
+      end
+      handlers[#handlers + 1] = f
+   end
+
+   function ObjectManager:get(path, interface, property)
+      local object = self.objects[path]
+      local properties = object and object[interface]
+      if property == nil or properties == nil then
+         return properties
+      end
+      return properties[property]
+   end
+
+   -- return the paths of all objects implementing interface
+   function ObjectManager:find(interface)
+      local paths = {}
+      for path, object in pairs(self.objects) do
+         if object[interface] then
+            paths[#paths + 1] = path
+         end
+      end
+      return paths
+   end
+
+   function ObjectManager:close()
+      unwatch(self.bus, self)
+      return self.bus:unref_match(self.rule)
+   end
+end
+
 do
    local EObject = {}
    EObject.__index = EObject
@@ -233,63 +1211,80 @@ do
       assert(getmetatable(o) == EObject,
          'bad argument #2 (expected an EObject)')
 
-      return self:register_object_path(o.path, o.lookup)
+      local r, msg = self:register_object_path(o.path, o.lookup, o)
+      if not r then return nil, msg end
+
+      -- where to send PropertiesChanged
+      o.bus = self
+      return true
    end
 
-   local sub, concat = string.sub, table.concat
+   function M.Bus:unregister_object(o)
+      assert(getmetatable(o) == EObject,
+         'bad argument #2 (expected an EObject)')
 
-   local function value_end(i, sig)
-      local char = sub(sig, i, i)
-      if char == 'a' then
-         return value_end(i+1, sig)
-      elseif char == '(' then
-         i = i+1
-         local n = #sig -- don't loop forever on broken signature
-         repeat
-            i = value_end(i, sig) + 1
-         until i > n or sub(sig, i, i) == ')'
-      elseif char == '{' then
-         i = value_end(i+1, sig)
-         i = value_end(i+1, sig) + 1
-      end
+      local r, msg = self:unregister_object_path(o.path)
+      if not r then return nil, msg end
 
-      return i
+      if o.bus == self then o.bus = nil end
+      return true
    end
 
-   local function method_xml(name, in_sig, out_sig)
-      local t, l = { '<method name="', name, '">' }, 3
+   local sub, method_xml = string.sub, M.method_xml
+   local clock, prepare_reply, Reply = M.clock, M.prepare_reply, M.Reply
 
-      local function write(s)
-         l = l+1
-         t[l] = s
-         return write
+   -- remember the reply of a cacheable method in its entry.
+   -- the C side answers from entry[4] until entry[5] is passed
+   local function store(entry, ttl, ...)
+      local reply = ...
+      if reply == nil and select('#', ...) > 1 then
+         -- errors aren't cached
+         return ...
       end
 
-      local i, n = 1, #in_sig
-      while i <= n do
-         local j = value_end(i, in_sig)
-         write '<arg direction="in" type="' (sub(in_sig, i, j)) '" />';
-         i = j+1
-      end
-      i, n = 1, #out_sig
-      while i <= n do
-         local j = value_end(i, out_sig)
-         write '<arg direction="out" type="' (sub(out_sig, i, j)) '" />';
-         i = j+1
+      if getmetatable(reply) ~= Reply then
+         reply = prepare_reply(entry[2], ...)
       end
-      write '</method>';
+      entry[4] = reply
+      entry[5] = ttl and clock() + ttl
+      return reply
+   end
 
-      return concat(t)
+   -- drop the reply of the object manager, if any, and have it
+   -- announce interfaces the object didn't have before
+   local function members_changed(o, interface, new)
+      local m = o.managed_by
+      if m then
+         m.reply = nil
+         if new then m.interface_added(m, o, interface) end
+      end
    end
 
-   function EObject:add_method(interface, name, in_sig, out_sig, f)
+   -- add a method to the object. f may be a worker pool instead
+   -- of a function. if cache is true the first reply is sent to
+   -- every later caller without calling f, until
+   -- invalidate_method() is called. a number caches the reply
+   -- for that many seconds
+   function EObject:add_method(interface, name, in_sig, out_sig, f, cache)
       if not in_sig  then in_sig  = '' end
       if not out_sig then out_sig = '' end
 
-      self.lookup[interface..'.'..name] = {in_sig, out_sig, f}
-      self.xml = nil
-
       local xml = method_xml(name, in_sig, out_sig)
+      local entry = {in_sig, out_sig, f}
+      if cache then
+         assert(type(f) == 'function',
+            'bad argument #5 (only functions can be cached)')
+         local ttl = type(cache) == 'number' and cache or nil
+         entry[3] = function(...)
+            return store(entry, ttl, f(...))
+         end
+      end
+      self.lookup[interface..'.'..name] = entry
+
+      local introspection = self.introspection
+      introspection[interface] = nil
+      introspection[1] = nil
+
       local interfaces = self.interfaces
       local methods = interfaces[interface]
       if methods then
@@ -297,34 +1292,231 @@ do
       else
          interfaces[interface] = { [name] = xml }
       end
+      members_changed(self, interface, not methods)
    end
 
-   local function generate_xml(interfaces)
-      local t, l = {[[
-<!DOCTYPE node PUBLIC "-//freedesktop//DTD D-BUS Object Introspection 1.0//EN"
-"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd">
-<node>]]}, 1
+   -- forget the cached reply of a cacheable method
+   function EObject:invalidate_method(interface, name)
+      local entry = self.lookup[interface..'.'..name]
+      if entry then
+         entry[4] = nil
+         entry[5] = nil
+      end
+   end
 
-      local function write(s)
-         l = l+1
-         t[l] = s
+   local INTERFACE_PROPERTIES = M.INTERFACE_PROPERTIES
+   local defer, new_error = M.defer, M.new_error
+   local unknown_interface =
+      new_error('org.freedesktop.DBus.Error.UnknownInterface')
+   local unknown_property =
+      new_error('org.freedesktop.DBus.Error.UnknownProperty')
+   local read_only = new_error('org.freedesktop.DBus.Error.PropertyReadOnly')
+   local access_denied = new_error('org.freedesktop.DBus.Error.AccessDenied')
+   local invalid_args = new_error('org.freedesktop.DBus.Error.InvalidArgs')
+
+   local function property_value(p)
+      if p.get then return p.get() end
+      return p.value
+   end
+
+   -- the readable properties of an interface as a{sv}
+   function EObject:get_all_properties(interface)
+      local t = {}
+      local properties = self.properties and self.properties[interface]
+      if properties then
+         for name, p in pairs(properties) do
+            if p.access ~= 'write' then
+               t[name] = {
+                  signature = p.signature,
+                  value = property_value(p)
+               }
+            end
+         end
+      end
+      return t
+   end
+
+   -- send one PropertiesChanged per interface for all the
+   -- changes made since the last pass of the main loop
+   local function flush_properties(o)
+      local pending = o.changed_properties
+      o.changed_properties = {}
+      o.properties_scheduled = nil
+
+      local bus = o.bus
+      if not bus then return end
+
+      local emit = o.properties_changed
+      if not emit or o.properties_changed_bus ~= bus then
+         emit = assert(bus:prepare_signal(o.path, INTERFACE_PROPERTIES,
+            'PropertiesChanged', 'sa{sv}as'))
+         o.properties_changed = emit
+         o.properties_changed_bus = bus
       end
 
-      for interface, methods in pairs(interfaces) do
-         write '<interface name="'
-         write(interface)
-         write '">'
-         for _, xml in pairs(methods) do
-            write(xml)
+      for interface, names in pairs(pending) do
+         local properties = o.properties[interface]
+         local changed, invalidated, n = {}, {}, 0
+         for name in pairs(names) do
+            local p = properties[name]
+            if p.access == 'write' then
+               n = n + 1
+               invalidated[n] = name
+            else
+               changed[name] = {
+                  signature = p.signature,
+                  value = property_value(p)
+               }
+            end
          end
-         write '</interface>'
+         emit(interface, changed, invalidated)
+      end
+   end
+
+   -- announce that a property changed. only needed for
+   -- properties with a getter, set_property() calls it
+   function EObject:property_changed(interface, name)
+      self.get_all_replies[interface] = nil
+      if self.managed_by then
+         self.managed_by.reply = nil
+      end
+
+      local pending = self.changed_properties
+      local names = pending[interface]
+      if not names then
+         names = {}
+         pending[interface] = names
+      end
+      names[name] = true
+
+      if not self.properties_scheduled then
+         self.properties_scheduled = true
+         defer(function() return flush_properties(self) end)
+      end
+   end
+
+   function EObject:get_property(interface, name)
+      local properties = self.properties[interface]
+      local p = properties and properties[name]
+      assert(p, 'no such property')
+      return property_value(p)
+   end
+
+   function EObject:set_property(interface, name, value)
+      local properties = self.properties[interface]
+      local p = properties and properties[name]
+      assert(p and not p.get, 'no such property, or it has a getter')
+      p.value = value
+      return self:property_changed(interface, name)
+   end
+
+   local function add_properties_interface(o)
+      o:add_method(INTERFACE_PROPERTIES, 'Get', 'ss', 'v',
+         function(interface, name)
+            local properties = o.properties[interface]
+            if not properties then return unknown_interface(interface) end
+            local p = properties[name]
+            if not p then return unknown_property(name) end
+            if p.access == 'write' then return access_denied(name) end
+
+            return { signature = p.signature, value = property_value(p) }
+         end)
+
+      o:add_method(INTERFACE_PROPERTIES, 'Set', 'ssv', '',
+         function(interface, name, value)
+            local properties = o.properties[interface]
+            if not properties then return unknown_interface(interface) end
+            local p = properties[name]
+            if not p then return unknown_property(name) end
+            if p.access == 'read' then return read_only(name) end
+
+            -- the variant may hold anything, and a value we can't
+            -- marshal would only blow up later in Get or GetAll
+            local ok, err = pcall(prepare_reply, p.signature, value)
+            if not ok then return invalid_args(err) end
+
+            if p.set then
+               -- setters refuse values like method handlers
+               -- return errors
+               local r, ename, emsg = p.set(value)
+               if r == nil and ename then return nil, ename, emsg end
+            end
+            if not p.get then p.value = value end
+            o:property_changed(interface, name)
+         end)
+
+      -- replies are marshalled once and reused until a property
+      -- of the interface changes. interfaces with getters can't
+      -- know when that happens, so they are marshalled every time
+      o:add_method(INTERFACE_PROPERTIES, 'GetAll', 's', 'a{sv}',
+         function(interface)
+            local reply = o.get_all_replies[interface]
+            if reply then return reply end
+
+            if not o.interfaces[interface] then
+               return unknown_interface(interface)
+            end
+            reply = prepare_reply('a{sv}', o:get_all_properties(interface))
+            if not o.dynamic_properties[interface] then
+               o.get_all_replies[interface] = reply
+            end
+            return reply
+         end)
+   end
+
+   -- add a property to the object. access is 'read', 'write' or
+   -- 'readwrite'. value is the initial value, or a function to
+   -- call for the value. set is called with new values from Set
+   -- and may refuse them by returning nil, error name, message
+   function EObject:add_property(interface, name, signature, access, value, set)
+      assert(access == 'read' or access == 'write' or access == 'readwrite',
+         'bad argument #4 (expected read, write or readwrite)')
+
+      if not self.properties then
+         self.properties = {}
+         self.get_all_replies = {}
+         self.dynamic_properties = {}
+         self.changed_properties = {}
+         add_properties_interface(self)
+      end
+
+      local properties = self.properties[interface]
+      if not properties then
+         properties = {}
+         self.properties[interface] = properties
+      end
+
+      local p = { signature = signature, access = access, set = set }
+      if type(value) == 'function' then
+         p.get = value
+         self.dynamic_properties[interface] = true
+      else
+         p.value = value
+      end
+      properties[name] = p
+      self.get_all_replies[interface] = nil
+
+      local xml = '<property name="'..name..'" type="'..signature..
+         '" access="'..access..'" />'
+      local interfaces = self.interfaces
+      local members = interfaces[interface]
+      if members then
+         members['property '..name] = xml
+      else
+         interfaces[interface] = { ['property '..name] = xml }
       end
 
-      write '</node>'
+      local introspection = self.introspection
+      introspection[interface] = nil
+      introspection[1] = nil
 
-      return concat(t)
+      members_changed(self, interface, not members)
    end
 
+   -- the introspection data is put together by Bus:introspect()
+   -- from fragments cached per interface in o.introspection
+   local introspect = M.Bus.introspect
+
    setmetatable(EObject, { __call = function(_, path)
       assert(path and path ~= '' and sub(path, 1, 1) == '/',
          'illegal object path')
@@ -332,17 +1524,14 @@ do
       t = {
          path = path,
          lookup = {
+            -- the true at index 6 gets us the connection the call
+            -- came in on, as the object may be exported on several
             ['org.freedesktop.DBus.Introspectable.Introspect'] =
-               {'', 's', function()
-                  local xml = t.xml
-                  if xml == nil then
-                     xml = generate_xml(t.interfaces)
-                     t.xml = xml
-                  end
-
-                  return xml
-               end}
+               {'', 's', function(bus)
+                  return introspect(bus, path, t.interfaces, t.introspection)
+               end, nil, nil, true}
          },
+         introspection = {},
          interfaces = {
             ['org.freedesktop.DBus.Introspectable'] = {
                ['Introspect'] = [[
@@ -354,6 +1543,241 @@ do
    end})
 end
 
+do
+   local pairs, next, getmetatable, setmetatable =
+      pairs, next, getmetatable, setmetatable
+   local match = string.match
+   local Bus, EObject = M.Bus, M.EObject
+   local defer, prepare_reply = M.defer, M.prepare_reply
+   local register_object_path = Bus.register_object_path
+   local unregister_object_path = Bus.unregister_object_path
+   local INTERFACE_OBJECT_MANAGER = M.INTERFACE_OBJECT_MANAGER
+
+   -- object managers registered on each connection by path
+   local managers = setmetatable({}, { __mode = 'k' })
+   -- ..and everything registered, so managers registered
+   -- after their children can find them
+   local exported = setmetatable({}, { __mode = 'k' })
+
+   -- the interfaces and properties of a registered
+   -- EObject or method table, as GetManagedObjects
+   -- and InterfacesAdded want them
+   local function object_interfaces(o)
+      local interfaces = {}
+      if getmetatable(o) == EObject then
+         for name in pairs(o.interfaces) do
+            interfaces[name] = o:get_all_properties(name)
+         end
+      else
+         for key in pairs(o) do
+            local name = match(key, '^(.*)%.[^.]*$')
+            if name then interfaces[name] = {} end
+         end
+      end
+      return interfaces
+   end
+
+   local function parent(path)
+      if path == '/' then return nil end
+      path = match(path, '^(.*)/[^/]*$')
+      if path == '' then return '/' end
+      return path
+   end
+
+   local function find_manager(ms, path)
+      path = parent(path)
+      while path do
+         local m = ms[path]
+         if m then return m end
+         path = parent(path)
+      end
+   end
+
+   -- send the signals for everything which changed since the
+   -- last pass of the main loop. an object registered and
+   -- unregistered again in the same pass is never seen
+   local function flush(m)
+      local pending, new_interfaces = m.pending, m.new_interfaces
+      m.pending = {}
+      m.new_interfaces = {}
+      m.scheduled = nil
+
+      for path, old in pairs(pending) do
+         local new = m.objects[path]
+         if old ~= new then
+            if old then
+               local names, n = {}, 0
+               for name in pairs(object_interfaces(old)) do
+                  n = n + 1
+                  names[n] = name
+               end
+               m.removed(path, names)
+            end
+            if new then
+               m.added(path, object_interfaces(new))
+            end
+         end
+      end
+
+      -- objects announced whole above already have them
+      for path, names in pairs(new_interfaces) do
+         local o = m.objects[path]
+         if o and (pending[path] == nil or pending[path] == o) then
+            local interfaces = {}
+            for name in pairs(names) do
+               interfaces[name] = o:get_all_properties(name)
+            end
+            m.added(path, interfaces)
+         end
+      end
+   end
+
+   local function schedule(m)
+      if not m.scheduled then
+         m.scheduled = true
+         defer(function() return flush(m) end)
+      end
+   end
+
+   local function changed(m, path, o)
+      local pending = m.pending
+      if pending[path] == nil then
+         pending[path] = m.objects[path] or false
+      end
+      local old = m.objects[path]
+      if old and getmetatable(old) == EObject then
+         old.managed_by = nil
+      end
+      if o and getmetatable(o) == EObject then
+         -- let property changes invalidate our reply
+         o.managed_by = m
+      end
+      m.objects[path] = o
+      m.reply = nil
+      schedule(m)
+   end
+
+   -- an interface was added to a managed object
+   local function interface_added(m, o, interface)
+      local path = o.path
+      if m.objects[path] ~= o then return end
+
+      local names = m.new_interfaces[path]
+      if not names then
+         names = {}
+         m.new_interfaces[path] = names
+      end
+      names[interface] = true
+      schedule(m)
+   end
+
+   local function attach(bus, o)
+      local m = o.manager
+      local r, msg = bus:prepare_signal(o.path,
+         INTERFACE_OBJECT_MANAGER, 'InterfacesAdded', 'oa{sa{sv}}')
+      if not r then return nil, msg end
+      m.added = r
+      r, msg = bus:prepare_signal(o.path,
+         INTERFACE_OBJECT_MANAGER, 'InterfacesRemoved', 'oas')
+      if not r then return nil, msg end
+      m.removed = r
+
+      local ms = managers[bus]
+      if not ms then
+         ms = {}
+         managers[bus] = ms
+      end
+      ms[o.path] = m
+
+      -- adopt the children already registered
+      for path, child in pairs(exported[bus]) do
+         if find_manager(ms, path) == m then
+            m.objects[path] = child
+            if getmetatable(child) == EObject then
+               child.managed_by = m
+            end
+         end
+      end
+      return true
+   end
+
+   function Bus:register_object_path(path, lookup, o)
+      local r, msg = register_object_path(self, path, lookup)
+      if not r then return nil, msg end
+
+      o = o or lookup
+      local objects = exported[self]
+      if not objects then
+         objects = {}
+         exported[self] = objects
+      end
+      objects[path] = o
+
+      local ms = managers[self]
+      local m = ms and find_manager(ms, path)
+      if m then changed(m, path, o) end
+
+      if getmetatable(o) == EObject and o.manager
+            and (not ms or ms[path] ~= o.manager) then
+         r, msg = attach(self, o)
+         if not r then return nil, msg end
+      end
+
+      return true
+   end
+
+   function Bus:unregister_object_path(path)
+      local r, msg = unregister_object_path(self, path)
+      if not r then return nil, msg end
+
+      local objects = exported[self]
+      if objects then objects[path] = nil end
+
+      local ms = managers[self]
+      if ms then
+         if ms[path] then ms[path] = nil end
+         local m = find_manager(ms, path)
+         if m then changed(m, path, nil) end
+      end
+
+      return true
+   end
+
+   -- make the object an org.freedesktop.DBus.ObjectManager for
+   -- all objects registered below it. GetManagedObjects is
+   -- answered from a reply marshalled once, unless an object has
+   -- properties with getters, and objects coming and going are
+   -- announced once per pass of the main loop
+   function EObject:add_object_manager()
+      local m = {
+         objects = {},
+         pending = {},
+         new_interfaces = {},
+         interface_added = interface_added
+      }
+      self.manager = m
+
+      self:add_method(INTERFACE_OBJECT_MANAGER, 'GetManagedObjects',
+         '', 'a{oa{sa{sv}}}', function()
+            local reply = m.reply
+            if not reply then
+               local objects, dynamic = {}, false
+               for path, o in pairs(m.objects) do
+                  objects[path] = object_interfaces(o)
+                  if o.dynamic_properties
+                        and next(o.dynamic_properties) then
+                     dynamic = true
+                  end
+               end
+               reply = prepare_reply('a{oa{sa{sv}}}', objects)
+               -- like GetAll, don't keep values from getters
+               if not dynamic then m.reply = reply end
+            end
+            return reply
+         end)
+   end
+end
+
 return M
 
 -- vi: syntax=lua ts=3 sw=3 et: